@@ -0,0 +1,731 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+	bench.c
+
+	Runs the workloads the quadtree is measured with. A scenario writes one
+	or more command scripts, runs the quadtree program on each and reports
+	the wall time and peak resident memory of the run, followed by the lines
+	of its output that hold measurements: LATENCY() percentiles, MEMORY(),
+	CACHE_STATS(), the SPATIAL_JOIN, SHARD_STATS() and REBALANCE summaries
+	and the slow command log.
+
+	usage: bench [-q quadtree] [-n scale] [scenario ...]
+
+	-q names the program to run (../src/quadtree by default), so that two
+	builds can be compared on the same scripts, and -n multiplies the size
+	of every workload. Without a scenario all of them run, in order.
+*/
+
+#define MAX_RUN_ARGS 8 //Most arguments given to the quadtree program
+#define RNG_SEED 0x9e3779b97f4a7c15ULL
+#define MAX_PRODUCERS 8 //Most clients of the producers scenario
+#define PRODUCER_BATCH 32 //Commands a client writes before reading their replies
+#define OVERHEAD_RUNS 5 //Runs of each side of the overhead scenario, of which the fastest counts
+#define JOIN_RUNS 4 //Joins in each run of the join scenario, which the time of building the layer is spread over
+#define NAME_DIGITS 5 //Base 36 digits of the generated rectangle names, after a prefix letter
+#define NAME_SPACE 60466176L //36^NAME_DIGITS names per prefix
+#define NAME_STRIDE 37370011L //Close to NAME_SPACE over the golden ratio, and prime to it
+#define WIDTH 19 //INIT_QUADTREE parameter of the scripts, the widest world whose coordinates fit in MAX_NAME_LEN digits
+
+typedef struct {
+	char *path; //Socket of the quadtree program
+	char prefix; //First letter of the names of the client's rectangles
+	long n; //Rectangles the client creates and inserts
+} producer_t;
+
+typedef struct {
+	char *name;
+	void (*run)(void);
+	char *what; //What the scenario measures
+} scenario_t;
+
+char *quadtree = "../src/quadtree"; //Program measured
+long scale = 1; //Multiplies the size of every workload
+unsigned long long rng_state = RNG_SEED;
+
+/*
+	Output lines holding measurements, printed after the run
+*/
+char *reported[] = {"LATENCY OF ", "MEMORY: ", "QUERY CACHE: ", "SPATIAL JOIN FOUND ", "SHARDS REBALANCED: ", "SHARD ", "SLOW COMMAND ", "quadtree: ", NULL};
+
+static unsigned long long rng_next(void) {
+	/*
+	** xorshift64*, so that every run of a scenario writes the same scripts
+	*/
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static long rng_range(long lo, long hi) {
+	/*
+	** Uniform in [lo, hi]
+	*/
+	return lo + (long)(rng_next() % (unsigned long long)(hi - lo + 1));
+}
+
+static char *rect_name(char *buf, char prefix, long i) {
+	/*
+	** Names rectangle i of a script, in the MAX_NAME_LEN characters the quadtree keeps;
+	** names sort in the order of i
+	*/
+	static const char digit[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	int d;
+
+	buf[0] = prefix;
+	for (d = NAME_DIGITS; d >= 1; d--) {
+		buf[d] = digit[i % 36];
+		i /= 36;
+	}
+	buf[NAME_DIGITS + 1] = '\0';
+	return buf;
+}
+
+static long scattered(long i) {
+	/*
+	** Spreads consecutive indices over the names, so that rectangles created in order
+	** still make a balanced name tree
+	*/
+	return (i * NAME_STRIDE) % NAME_SPACE;
+}
+
+static void create_rect(FILE *script, char prefix, long i, long cx, long cy, long lx, long ly) {
+	char name[NAME_DIGITS + 2];
+
+	fprintf(script, "CREATE_RECTANGLE(%s,%ld,%ld,%ld,%ld)\n", rect_name(name, prefix, i), cx, cy, lx, ly);
+}
+
+static void insert_rect(FILE *script, char prefix, long i) {
+	char name[NAME_DIGITS + 2];
+
+	fprintf(script, "INSERT(%s)\n", rect_name(name, prefix, i));
+}
+
+static void random_layer(FILE *script, char prefix, long n, long max_len) {
+	/*
+	** Creates and inserts n rectangles spread evenly over the world, of extents up to
+	** max_len
+	*/
+	long i, lx, ly;
+
+	for (i = 0; i < n; i++) {
+		lx = rng_range(1, max_len);
+		ly = rng_range(1, max_len);
+		create_rect(script, prefix, scattered(i), rng_range(lx, (1L << WIDTH) - lx), rng_range(ly, (1L << WIDTH) - ly), lx, ly);
+		insert_rect(script, prefix, scattered(i));
+	}
+}
+
+static double rng_unit(void) {
+	/*
+	** Uniform in [0, 1)
+	*/
+	return (rng_next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+static double now(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void report(FILE *from) {
+	/*
+	** Prints the lines of from that hold measurements
+	*/
+	char *line = NULL;
+	size_t size = 0;
+	int r;
+
+	while (getline(&line, &size, from) > 0)
+		for (r = 0; reported[r] != NULL; r++)
+			if (strncmp(line, reported[r], strlen(reported[r])) == 0) {
+				printf("\t%s", line);
+				break;
+			}
+	free(line);
+}
+
+static double run_script(FILE *script, char *label, char *args[]) {
+	/*
+	** Runs the quadtree program with args on script, reports the run and returns its
+	** wall time. The wall time covers reading the script, so scenarios compare runs of
+	** the same size; the latencies isolate the commands. The standard error, where the
+	** slow command log goes, is kept apart so that its lines do not break into the
+	** buffered output.
+	*/
+	char *argv[MAX_RUN_ARGS + 2];
+	struct rusage usage;
+	double start, wall;
+	int out[2], status, a;
+	pid_t pid;
+	FILE *from, *err = tmpfile();
+
+	argv[0] = quadtree;
+	for (a = 0; (args != NULL) && (args[a] != NULL) && (a < MAX_RUN_ARGS); a++)
+		argv[a + 1] = args[a];
+	argv[a + 1] = NULL;
+
+	fflush(script);
+	rewind(script);
+	fflush(stdout);
+	if (pipe(out) != 0) {
+		perror("bench: pipe");
+		exit(1);
+	}
+	start = now();
+	if ((pid = fork()) == 0) {
+		dup2(fileno(script), STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(fileno(err), STDERR_FILENO);
+		close(out[0]);
+		close(out[1]);
+		execv(quadtree, argv);
+		perror(quadtree);
+		_exit(127);
+	}
+	close(out[1]);
+
+	printf("%s:", label);
+	for (a = 1; argv[a] != NULL; a++)
+		printf(" %s", argv[a]);
+	printf("\n");
+	from = fdopen(out[0], "r");
+	report(from);
+	fclose(from);
+
+	wait4(pid, &status, 0, &usage);
+	rewind(err);
+	report(err);
+	fclose(err);
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+		printf("\tFAILED WITH STATUS %d\n", status);
+	wall = now() - start;
+	printf("\tWALL %.3f S, MAX RSS %ld KB\n", wall, usage.ru_maxrss);
+	return wall;
+}
+
+static void deep_trees(void) {
+	/*
+	** Rectangles created in name order degenerate the name tree into a list. Half of the
+	** rectangles cross the vertical axis of the root close to its center, making a long
+	** chain in its axis tree, and the other half cluster next to the center, making deep
+	** quadtree paths.
+	*/
+	long n = 10000 * scale, i, c = 1L << (WIDTH - 1);
+	char name[NAME_DIGITS + 2];
+	FILE *script = tmpfile();
+
+	fprintf(script, "INIT_QUADTREE(%d)\n", WIDTH);
+	for (i = 0; i < n; i++) {
+		if (i % 2 == 0)
+			create_rect(script, 'D', i, c, c - rng_range(2, 1 << 12), rng_range(1, 8), 1);
+		else
+			create_rect(script, 'D', i, c + rng_range(16, 1 << 12), c + rng_range(16, 1 << 12), rng_range(1, 4), rng_range(1, 4));
+		insert_rect(script, 'D', i);
+	}
+	for (i = 0; i < n; i++)
+		if (i % 2 == 0)
+			fprintf(script, "SEARCH_POINT(%ld,%ld)\n", c, c - rng_range(2, 1 << 12));
+		else
+			fprintf(script, "SEARCH_POINT(%ld,%ld)\n", c + rng_range(16, 1 << 12), c + rng_range(16, 1 << 12));
+	for (i = 0; i < 20; i++) {
+		fprintf(script, "LIST_RECTANGLES()\n");
+		fprintf(script, "DISPLAY()\n");
+		fprintf(script, "WINDOW(%ld,%ld,%d,%d)\n", c - (1L << 13), c - (1L << 13), 1 << 14, 1 << 14);
+	}
+	for (i = 0; i < n; i += 2)
+		fprintf(script, "DELETE_RECTANGLE(%s)\n", rect_name(name, 'D', i));
+	fprintf(script, "LATENCY()\n");
+	run_script(script, "deep", NULL);
+	fclose(script);
+}
+
+static void window_aggregates(void) {
+	/*
+	** The same windows, from a few cells to a quarter of the world wide, enumerated by
+	** WINDOW and counted by COUNT_WINDOW and AREA_WINDOW from the subtree summaries, one
+	** run each. A run of the layer alone is subtracted from the others to give the time
+	** the windows take, and LATENCY() gives the spread of each command.
+	*/
+	char *label[] = {"count layer", "count WINDOW", "count COUNT_WINDOW", "count AREA_WINDOW"};
+	char *command[] = {NULL, "WINDOW", "COUNT_WINDOW", "AREA_WINDOW"};
+	long n = 200000 * scale, q = 10000, i, w;
+	long *box = (long *)malloc(4 * q * sizeof(long));
+	double wall[4];
+	FILE *script;
+	int c;
+
+	for (i = 0; i < q; i++) {
+		w = 1L << rng_range(4, WIDTH - 2);
+		box[4 * i] = rng_range(0, (1L << WIDTH) - w);
+		box[4 * i + 1] = rng_range(0, (1L << WIDTH) - w);
+		box[4 * i + 2] = box[4 * i + 3] = w;
+	}
+	for (c = 0; c < 4; c++) {
+		script = tmpfile();
+		rng_state = RNG_SEED; // every run gets the same layer
+		fprintf(script, "INIT_QUADTREE(%d)\n", WIDTH);
+		random_layer(script, 'A', n, 64);
+		for (i = 0; (c > 0) && (i < q); i++)
+			fprintf(script, "%s(%ld,%ld,%ld,%ld)\n", command[c], box[4 * i], box[4 * i + 1], box[4 * i + 2], box[4 * i + 3]);
+		fprintf(script, "LATENCY()\n");
+		wall[c] = run_script(script, label[c], NULL);
+		fclose(script);
+	}
+	printf("count: %.3f S ENUMERATING, %.3f S COUNTING, %.3f S SUMMING AREAS\n",
+		wall[1] - wall[0], wall[2] - wall[0], wall[3] - wall[0]);
+	free(box);
+}
+
+static void zipf_cache(void) {
+	/*
+	** A query mix over K distinct point, rectangle and window queries, the query of rank r
+	** drawn with probability proportional to 1/r, and one insert in a hundred commands,
+	** run with the query cache off and on
+	*/
+	long n = 100000 * scale, q = 200000 * scale, k = 1000, i, r, lo, hi, w;
+	double *cdf = (double *)malloc(k * sizeof(double)), u, total = 0;
+	char name[NAME_DIGITS + 2];
+	char **query = (char **)malloc(k * sizeof(char *));
+	FILE *script;
+	int on;
+
+	for (r = 0; r < k; r++) {
+		total += 1.0 / (r + 1);
+		cdf[r] = total;
+		query[r] = (char *)malloc(64);
+		w = 1L << rng_range(6, 12);
+		if (r % 3 == 0)
+			sprintf(query[r], "SEARCH_POINT(%ld,%ld)", rng_range(0, (1L << WIDTH) - 1), rng_range(0, (1L << WIDTH) - 1));
+		else if (r % 3 == 1)
+			sprintf(query[r], "RECTANGLE_SEARCH(%s)", rect_name(name, 'Z', scattered(rng_range(0, n - 1))));
+		else
+			sprintf(query[r], "COUNT_WINDOW(%ld,%ld,%ld,%ld)", rng_range(0, (1L << WIDTH) - w), rng_range(0, (1L << WIDTH) - w), w, w);
+	}
+
+	for (on = 0; on <= 1; on++) {
+		script = tmpfile();
+		rng_state = RNG_SEED; // both runs get the same commands
+		fprintf(script, "INIT_QUADTREE(%d)\n", WIDTH);
+		random_layer(script, 'Z', n, 64);
+		fprintf(script, "CACHE(%s)\n", on ? "ON" : "OFF");
+		for (i = 0; i < q; i++) {
+			if (i % 100 == 99) {
+				w = rng_range(1, 64);
+				create_rect(script, 'N', i, rng_range(w, (1L << WIDTH) - w), rng_range(w, (1L << WIDTH) - w), w, w);
+				insert_rect(script, 'N', i);
+				continue;
+			}
+			u = rng_unit() * total;
+			for (lo = 0, hi = k - 1; lo < hi; )
+				if (cdf[(lo + hi) / 2] < u)
+					lo = (lo + hi) / 2 + 1;
+				else
+					hi = (lo + hi) / 2;
+			fprintf(script, "%s\n", query[lo]);
+		}
+		fprintf(script, "CACHE_STATS()\nLATENCY()\n");
+		run_script(script, on ? "zipf cache on" : "zipf cache off", NULL);
+		fclose(script);
+	}
+
+	for (r = 0; r < k; r++)
+		free(query[r]);
+	free(query);
+	free(cdf);
+}
+
+static void writes_under_scan(void) {
+	/*
+	** Inserts and deletes on their own, while a WINDOW over the whole world stays open and
+	** is paged by FETCH, so that every write copies its path, and between DISPLAY() runs,
+	** which hold the writes back until they finish. A run of the layer alone is subtracted
+	** from the others to give the write throughput.
+	*/
+	char *label[] = {"scan layer", "scan none", "scan open", "scan display"};
+	long n = 100000 * scale, w = 50000 * scale, i, l;
+	char name[NAME_DIGITS + 2];
+	double wall[4];
+	FILE *script;
+	int scan;
+
+	for (scan = 0; scan < 4; scan++) {
+		script = tmpfile();
+		rng_state = RNG_SEED; // every run gets the same commands
+		// Only the writes after the layer is built are timed
+		fprintf(script, "LATENCY(OFF)\nINIT_QUADTREE(%d)\n", WIDTH);
+		random_layer(script, 'S', n, 64);
+		fprintf(script, "LATENCY(ON)\n");
+		if (scan == 2)
+			fprintf(script, "WINDOW(0,0,%ld,%ld,10)\n", 1L << WIDTH, 1L << WIDTH);
+		for (i = 0; (scan > 0) && (i < w); i++) {
+			if (i % 2 == 0) {
+				l = rng_range(1, 64);
+				create_rect(script, 'W', scattered(i), rng_range(l, (1L << WIDTH) - l), rng_range(l, (1L << WIDTH) - l), l, l);
+				insert_rect(script, 'W', scattered(i));
+			}
+			else
+				fprintf(script, "DELETE_RECTANGLE(%s)\n", rect_name(name, 'S', scattered(i)));
+			if ((scan == 2) && (i % 100 == 99))
+				fprintf(script, "FETCH(10)\n");
+			if ((scan == 3) && (i % 10000 == 9999))
+				fprintf(script, "DISPLAY()\n");
+		}
+		fprintf(script, "MEMORY()\nLATENCY()\n");
+		wall[scan] = run_script(script, label[scan], NULL);
+		fclose(script);
+	}
+	printf("scan: %.0f WRITES/S ALONE, %.0f WITH A WINDOW OPEN, %.0f BETWEEN DISPLAYS\n",
+		w / (wall[1] - wall[0]), w / (wall[2] - wall[0]), w / (wall[3] - wall[0]));
+}
+
+static FILE *connect_client(char *path) {
+	/*
+	** Connects to the quadtree program listening at path, waiting for it to start
+	*/
+	struct sockaddr_un addr;
+	int fd, tries;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	for (tries = 0; tries < 1000; tries++) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fdopen(fd, "r+");
+		close(fd);
+		usleep(10000);
+	}
+	fprintf(stderr, "bench: cannot connect to %s\n", path);
+	exit(1);
+}
+
+static void *produce(void *arg) {
+	/*
+	** Creates and inserts the rectangles of one client, PRODUCER_BATCH commands at a time
+	*/
+	producer_t *producer = arg;
+	FILE *server = connect_client(producer->path);
+	char name[NAME_DIGITS + 2];
+	char *line = NULL;
+	size_t size = 0;
+	long i, j, l, x, y, seed = producer->prefix;
+	int sent;
+
+	for (i = 0; i < producer->n; i += PRODUCER_BATCH / 2) {
+		sent = 0;
+		for (j = i; (j < producer->n) && (j < i + PRODUCER_BATCH / 2); j++) {
+			// A generator of its own, as the clients run at once
+			seed = seed * 6364136223846793005L + 1442695040888963407L;
+			l = 1 + ((seed >> 33) & 63);
+			x = l + (long)(((unsigned long)seed >> 7) % ((1UL << WIDTH) - 2 * l));
+			y = l + (long)(((unsigned long)seed >> 23) % ((1UL << WIDTH) - 2 * l));
+			rect_name(name, producer->prefix, scattered(j));
+			fprintf(server, "CREATE_RECTANGLE(%s,%ld,%ld,%ld,%ld)\nINSERT(%s)\n", name, x, y, l, l, name);
+			sent += 2;
+		}
+		fflush(server);
+		while ((sent-- > 0) && (getline(&line, &size, server) > 0))
+			;
+	}
+	free(line);
+	fclose(server);
+	return NULL;
+}
+
+static void ingest_producers(void) {
+	/*
+	** Clients creating and inserting rectangles over the Unix socket of the quadtree
+	** program at once, the same number of commands in all for every number of clients
+	*/
+	long n = 100000 * scale;
+	char dir[] = "/tmp/benchXXXXXX", path[64], *line = NULL;
+	pthread_t thread[MAX_PRODUCERS];
+	producer_t producer[MAX_PRODUCERS];
+	size_t size = 0;
+	int producers, p, status, in[2];
+	double start, seconds;
+	struct rusage usage;
+	FILE *server, *to;
+	pid_t pid;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("bench: mkdtemp");
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/socket", dir);
+
+	for (producers = 1; producers <= MAX_PRODUCERS; producers *= 2) {
+		// The program serves the socket until its standard input ends
+		fflush(stdout);
+		if (pipe(in) != 0) {
+			perror("bench: pipe");
+			exit(1);
+		}
+		if ((pid = fork()) == 0) {
+			dup2(in[0], STDIN_FILENO);
+			close(in[0]);
+			close(in[1]);
+			if (freopen("/dev/null", "w", stdout) == NULL)
+				_exit(127);
+			execl(quadtree, quadtree, "-u", path, (char *)NULL);
+			_exit(127);
+		}
+		close(in[0]);
+		to = fdopen(in[1], "w");
+
+		server = connect_client(path);
+		fprintf(server, "INIT_QUADTREE(%d)\n", WIDTH);
+		fflush(server);
+		if (getline(&line, &size, server) <= 0)
+			fprintf(stderr, "bench: no reply from %s\n", quadtree);
+		fclose(server);
+
+		start = now();
+		for (p = 0; p < producers; p++) {
+			producer[p].path = path;
+			producer[p].prefix = 'A' + p;
+			producer[p].n = n / producers;
+			pthread_create(&thread[p], NULL, produce, &producer[p]);
+		}
+		for (p = 0; p < producers; p++)
+			pthread_join(thread[p], NULL);
+		seconds = now() - start;
+
+		fclose(to);
+		wait4(pid, &status, 0, &usage);
+		printf("producers: %d %s\n", producers, producers == 1 ? "CLIENT" : "CLIENTS");
+		printf("\t%ld COMMANDS IN %.3f S, %.0f COMMANDS/S, MAX RSS %ld KB\n", 2 * (n / producers) * producers,
+			seconds, 2 * (n / producers) * producers / seconds, usage.ru_maxrss);
+	}
+	free(line);
+	rmdir(dir);
+}
+
+static void sharded_throughput(void) {
+	/*
+	** Inserts, then point and window queries of which three in four fall in one hot corner
+	** of the world, with a rebalance half way through the queries, on one process and on
+	** 1, 2 and 4 workers
+	*/
+	long n = 100000 * scale, q = 60000 * scale, i, w, hot = 1L << (WIDTH - 5);
+	char *args[][3] = {{NULL}, {"-s", "1", NULL}, {"-s", "2", NULL}, {"-s", "4", NULL}};
+	char label[32];
+	FILE *script = tmpfile();
+	int a;
+
+	fprintf(script, "INIT_QUADTREE(%d)\n", WIDTH);
+	random_layer(script, 'H', n, 64);
+	for (i = 0; i < q; i++) {
+		w = (i % 4 == 3) ? (1L << WIDTH) : hot;
+		if (i % 2 == 0)
+			fprintf(script, "SEARCH_POINT(%ld,%ld)\n", rng_range(0, w - 1), rng_range(0, w - 1));
+		else
+			fprintf(script, "COUNT_WINDOW(%ld,%ld,%d,%d)\n", rng_range(0, w - 1024), rng_range(0, w - 1024), 1024, 1024);
+		if (i == q / 2)
+			fprintf(script, "SHARD_STATS()\nREBALANCE()\n");
+	}
+	fprintf(script, "SHARD_STATS()\nLATENCY()\n");
+	for (a = 0; a < 4; a++) {
+		snprintf(label, sizeof(label), "shards %s", a == 0 ? "none" : args[a][1]);
+		run_script(script, label, args[a]);
+	}
+	fclose(script);
+}
+
+static void memory_footprint(void) {
+	/*
+	** A large sparse layer of small rectangles, where most child slots of the quadtree
+	** and axis nodes are empty, with the footprint reported by MEMORY() and the peak RSS,
+	** then point and rectangle searches to check the query latency at that size
+	*/
+	long n = 1000000 * scale, q = 100000, i;
+	char name[NAME_DIGITS + 2];
+	FILE *script = tmpfile();
+
+	fprintf(script, "INIT_QUADTREE(%d)\nLATENCY(OFF)\n", WIDTH);
+	random_layer(script, 'M', n, 16);
+	fprintf(script, "MEMORY()\nLATENCY(ON)\n");
+	for (i = 0; i < q; i++) {
+		fprintf(script, "SEARCH_POINT(%ld,%ld)\n", rng_range(0, (1L << WIDTH) - 1), rng_range(0, (1L << WIDTH) - 1));
+		fprintf(script, "RECTANGLE_SEARCH(%s)\n", rect_name(name, 'M', scattered(rng_range(0, n - 1))));
+	}
+	fprintf(script, "LATENCY()\n");
+	run_script(script, "memory", NULL);
+	fclose(script);
+}
+
+static void bulk_queries(void) {
+	/*
+	** A layer followed by a long run of point and rectangle searches, which the quadtree
+	** runs on a pool of query threads, with 1, 2, 4 and 8 threads
+	*/
+	long n = 100000 * scale, q = 100000 * scale, i;
+	char *args[][3] = {{"-j", "1", NULL}, {"-j", "2", NULL}, {"-j", "4", NULL}, {"-j", "8", NULL}};
+	char name[NAME_DIGITS + 2], label[32];
+	FILE *script = tmpfile();
+	int a;
+
+	fprintf(script, "INIT_QUADTREE(%d)\n", WIDTH);
+	random_layer(script, 'J', n, 64);
+	for (i = 0; i < q; i++) {
+		fprintf(script, "SEARCH_POINT(%ld,%ld)\n", rng_range(0, (1L << WIDTH) - 1), rng_range(0, (1L << WIDTH) - 1));
+		fprintf(script, "RECTANGLE_SEARCH(%s)\n", rect_name(name, 'J', scattered(rng_range(0, n - 1))));
+	}
+	for (a = 0; a < 4; a++) {
+		snprintf(label, sizeof(label), "threads %s", args[a][1]);
+		run_script(script, label, args[a]);
+	}
+	fclose(script);
+}
+
+static void spatial_joins(void) {
+	/*
+	** All the overlapping pairs of a million-rectangle layer, found by the plane sweep, by
+	** probing the quadtree and with no engine given, which sweeps, JOIN_RUNS times in one
+	** run each. Run with -n 10 for ten million rectangles. A run of the layer alone is
+	** subtracted from the others to give the time of one join, and the slow command log
+	** times each join on its own.
+	*/
+	char *label[] = {"join layer", "join SWEEP", "join PROBE", "join default"};
+	char *engine[] = {NULL, "SWEEP", "PROBE", ""};
+	long n = 1000000 * scale;
+	char *args[] = {"-l", "100000", NULL};
+	double wall[4];
+	FILE *script;
+	int e, r;
+
+	for (e = 0; e < 4; e++) {
+		script = tmpfile();
+		rng_state = RNG_SEED; // every run gets the same layer
+		fprintf(script, "INIT_QUADTREE(%d)\n", WIDTH);
+		random_layer(script, 'S', n, 16);
+		for (r = 0; (e > 0) && (r < JOIN_RUNS); r++)
+			fprintf(script, "SPATIAL_JOIN(%s)\n", engine[e]);
+		wall[e] = run_script(script, label[e], args);
+		fclose(script);
+	}
+	printf("join: %.3f S BY PLANE SWEEP, %.3f S BY PROBING, %.3f S WITH NO ENGINE GIVEN\n",
+		(wall[1] - wall[0]) / JOIN_RUNS, (wall[2] - wall[0]) / JOIN_RUNS, (wall[3] - wall[0]) / JOIN_RUNS);
+}
+
+static void descent_levels(void) {
+	/*
+	** Rectangles that are stored exactly L levels down, one run per L: each covers the
+	** center of a different quadrant of level L, at odd multiples of 2^(WIDTH-1-L) in x
+	** and y, and is too small to meet any deeper axis, so it sits at the root of the
+	** quadrant's axis tree and the descent is all quadtree levels
+	*/
+	long n, i, side, step;
+	char name[NAME_DIGITS + 2], label[32];
+	int levels[] = {4, 8, 12, 16}, l;
+	FILE *script;
+
+	for (l = 0; l < 4; l++) {
+		side = 1L << levels[l];
+		step = 1L << (WIDTH - 1 - levels[l]);
+		n = (20000 * scale < side * side) ? 20000 * scale : side * side;
+		script = tmpfile();
+		fprintf(script, "INIT_QUADTREE(%d)\n", WIDTH);
+		for (i = 0; i < n; i++) {
+			create_rect(script, 'L', scattered(i), (2 * (i % side) + 1) * step, (2 * (i / side) + 1) * step, 1, 1);
+			insert_rect(script, 'L', scattered(i));
+		}
+		for (i = 0; i < 20000 * scale; i++)
+			fprintf(script, "RECTANGLE_SEARCH(%s)\n", rect_name(name, 'L', scattered(rng_range(0, n - 1))));
+		fprintf(script, "LATENCY()\n");
+		snprintf(label, sizeof(label), "descent %d", levels[l]);
+		run_script(script, label, NULL);
+		fclose(script);
+	}
+}
+
+static void recording_overhead(void) {
+	/*
+	** The same layer and point searches, the cheapest command to time, with the latency
+	** recording on as by default and turned off by LATENCY(OFF) up front. Each is run a
+	** few times and the fastest run counts.
+	*/
+	long n = 100000 * scale, q = 200000 * scale, i;
+	double best[2] = {0, 0}, wall;
+	FILE *script[2] = {tmpfile(), tmpfile()};
+	int r, s;
+
+	fprintf(script[1], "LATENCY(OFF)\n");
+	for (s = 0; s < 2; s++) {
+		rng_state = RNG_SEED;
+		fprintf(script[s], "INIT_QUADTREE(%d)\n", WIDTH);
+		random_layer(script[s], 'O', n, 64);
+		for (i = 0; i < q; i++)
+			fprintf(script[s], "SEARCH_POINT(%ld,%ld)\n", rng_range(0, (1L << WIDTH) - 1), rng_range(0, (1L << WIDTH) - 1));
+	}
+	for (r = 0; r < OVERHEAD_RUNS; r++)
+		for (s = 0; s < 2; s++) {
+			wall = run_script(script[s], s == 0 ? "overhead recording" : "overhead not recording", NULL);
+			if ((r == 0) || (wall < best[s]))
+				best[s] = wall;
+		}
+	printf("overhead: FASTEST RUN %.3f S RECORDING, %.3f S NOT RECORDING, %.2f%% OVERHEAD\n",
+		best[0], best[1], 100 * (best[0] - best[1]) / best[1]);
+	fclose(script[0]);
+	fclose(script[1]);
+}
+
+scenario_t scenarios[] = {
+	{"deep", deep_trees, "traversals of a list-shaped name tree and deep quadtree and axis paths"},
+	{"count", window_aggregates, "COUNT_WINDOW and AREA_WINDOW against enumerating the same windows"},
+	{"zipf", zipf_cache, "a Zipf-skewed query mix with the query cache off and on"},
+	{"producers", ingest_producers, "create and insert throughput against the number of socket clients"},
+	{"scan", writes_under_scan, "insert and delete throughput and latency alone, under an open window and between displays"},
+	{"shards", sharded_throughput, "a skewed query load on one process and on sharded workers, with a rebalance"},
+	{"memory", memory_footprint, "the footprint of a million-rectangle sparse layer and its query latency"},
+	{"threads", bulk_queries, "a run of point and rectangle searches on 1, 2, 4 and 8 query threads"},
+	{"join", spatial_joins, "SPATIAL_JOIN of a million-rectangle layer by plane sweep, by probing and by default"},
+	{"descent", descent_levels, "INSERT and RECTANGLE_SEARCH of rectangles stored 4, 8, 12 and 16 levels down"},
+	{"overhead", recording_overhead, "point searches with the latency recording on and off"},
+	{NULL, NULL, NULL}
+};
+
+int main(int argc, char *argv[]) {
+	int first, i, s, chosen;
+
+	for (first = 1; (first + 1 < argc) && (argv[first][0] == '-'); first += 2)
+		if (strcmp(argv[first], "-q") == 0)
+			quadtree = argv[first + 1];
+		else if ((strcmp(argv[first], "-n") == 0) && (atol(argv[first + 1]) >= 1))
+			scale = atol(argv[first + 1]);
+		else
+			break;
+	for (i = first; i < argc; i++) {
+		for (s = 0; (scenarios[s].name != NULL) && (strcmp(argv[i], scenarios[s].name) != 0); s++)
+			;
+		if (scenarios[s].name == NULL) {
+			fprintf(stderr, "usage: bench [-q quadtree] [-n scale] [scenario ...]\nscenarios:\n");
+			for (s = 0; scenarios[s].name != NULL; s++)
+				fprintf(stderr, "\t%-10s %s\n", scenarios[s].name, scenarios[s].what);
+			return (1);
+		}
+	}
+
+	for (s = 0; scenarios[s].name != NULL; s++) {
+		chosen = (first == argc);
+		for (i = first; i < argc; i++)
+			chosen |= (strcmp(argv[i], scenarios[s].name) == 0);
+		if (chosen)
+			scenarios[s].run();
+	}
+	return (0);
+}
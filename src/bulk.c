@@ -0,0 +1,96 @@
+#include "bulk.h"
+
+/*
+	bulk.c
+
+	Chunks are claimed with a compare-and-swap on ticket, so a thread that
+	finishes its chunk early takes another one. The ticket counts the chunks
+	left to hand out, which go from the last to the first, and also holds the
+	generation of the job: a thread still looking for work in a finished job
+	cannot claim a chunk of the next one.
+*/
+
+static void bulk_work(bulk_pool_t *pool, unsigned long generation) {
+	unsigned long ticket = atomic_load_explicit(&pool->ticket, memory_order_acquire);
+
+	while (1) {
+		if (((ticket >> 32) != generation) || ((ticket & 0xffffffffUL) == 0))
+			return;
+		if (!atomic_compare_exchange_weak_explicit(&pool->ticket, &ticket, ticket - 1, memory_order_acq_rel, memory_order_acquire))
+			continue;
+
+		pool->run(pool->job, (ticket & 0xffffffffUL) - 1);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->unfinished == 0)
+			pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+		ticket = atomic_load_explicit(&pool->ticket, memory_order_acquire);
+	}
+}
+
+static void *bulk_worker(void *arg) {
+	bulk_pool_t *pool = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->stopping && (pool->generation == seen))
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->stopping)
+			break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+		bulk_work(pool, seen);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+void bulk_start(bulk_pool_t *pool, int threads) {
+	int i;
+
+	pool->threads = threads;
+	pool->unfinished = 0;
+	pool->generation = 0;
+	pool->stopping = 0;
+	atomic_init(&pool->ticket, 0);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 1; i < threads; i++)
+		pthread_create(&pool->worker[i], NULL, bulk_worker, pool);
+}
+
+void bulk_run(bulk_pool_t *pool, bulk_chunk_t run, void *job, int chunks) {
+	unsigned long generation;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->run = run;
+	pool->job = job;
+	pool->unfinished = chunks;
+	generation = ++pool->generation;
+	atomic_store_explicit(&pool->ticket, (generation << 32) | chunks, memory_order_release);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	bulk_work(pool, generation);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->unfinished > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void bulk_stop(bulk_pool_t *pool) {
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 1; i < pool->threads; i++)
+		pthread_join(pool->worker[i], NULL);
+}
@@ -0,0 +1,46 @@
+#ifndef BULK_H_
+#define BULK_H_
+
+/*
+	bulk.h
+
+	Pool of threads that run the chunks of a job in parallel. The thread
+	submitting a job works on its chunks too, and gets control back once
+	every chunk is done. Jobs are submitted by one thread at a time.
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX_BULK_THREADS 64 //Most threads in a pool, including the submitting one
+
+typedef void (*bulk_chunk_t)(void *job, int chunk);
+
+typedef struct {
+	int threads; //Threads working on a job, including the submitting one
+	pthread_t worker[MAX_BULK_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t wake; //Signalled when a job is submitted or the pool stops
+	pthread_cond_t done; //Signalled when the last chunk of a job is finished
+	bulk_chunk_t run; //Current job
+	void *job;
+	atomic_ulong ticket; //Generation of the current job in the high half, chunks left to hand out in the low half
+	int unfinished; //Chunks of the current job not finished yet
+	unsigned long generation; //Bumped by every job, so that idle workers notice it
+	int stopping;
+} bulk_pool_t;
+
+/*	Starts threads - 1 worker threads. */
+
+extern void bulk_start(bulk_pool_t *pool, int threads);
+
+/*	Calls run(job, c) for every chunk c in [0, chunks), spread over the
+	pool, and returns when all of them are finished. */
+
+extern void bulk_run(bulk_pool_t *pool, bulk_chunk_t run, void *job, int chunks);
+
+/*	Joins the worker threads. */
+
+extern void bulk_stop(bulk_pool_t *pool);
+
+#endif /* BULK_H_ */
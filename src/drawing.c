@@ -7,6 +7,8 @@
 	A C/C++ implementation of drawing primitives.
 */
 
+static FILE *picture; /* Stream of the current picture, set by StartPicture */
+
 
 
 
@@ -14,12 +16,14 @@
 	other drawing routines are called. The size of the picture
 	is assumed to be lx * ly, with the origin (0,0) in the lower
 	left corner. You can draw outside of the boundary of the
-	picture area, but it may not be displayed or printed.
+	picture area, but it may not be displayed or printed. The
+	picture is printed to out.
 	Output: $$$$ SP(lx,ly) */
 
-void StartPicture(double lx, double ly)
+void StartPicture(FILE *out, double lx, double ly)
 {
-		printf("$$$$ SP(%.2lf,%.2lf)\n", lx, ly);
+		picture = out;
+		fprintf(picture, "$$$$ SP(%.2lf,%.2lf)\n", lx, ly);
 }
 
 /*	Marks the end of the current picture. After this call, no
@@ -28,7 +32,7 @@ void StartPicture(double lx, double ly)
 
 void EndPicture(void)
 {
-	printf("EP\n");
+	fprintf(picture, "EP\n");
 }
 
 /*	Sets the dash of subsequently drawn lines and rectangles.
@@ -43,7 +47,7 @@ void EndPicture(void)
 
 void SetLineDash(int black, int white)
 {
-	printf("LD(%d,%d)\n", black, white);
+	fprintf(picture, "LD(%d,%d)\n", black, white);
 }
 
 /*	Draws a line with end points (x1, y1) and (x2, y2). The current
@@ -52,7 +56,7 @@ void SetLineDash(int black, int white)
 
 void DrawLine(double x1, double y1, double x2, double y2)
 {
-	printf("DL(%.2lf,%.2lf,%.2lf,%.2lf)\n", x1, y1, x2, y2);
+	fprintf(picture, "DL(%.2lf,%.2lf,%.2lf,%.2lf)\n", x1, y1, x2, y2);
 }
 
 /*	Draws a rectangle with top left corner at (x1, y1) and bottom
@@ -61,7 +65,7 @@ void DrawLine(double x1, double y1, double x2, double y2)
 
 void DrawRect( double x1, double y1, double x2, double y2)
 {
-	printf("DR(%.2lf,%.2lf,%.2lf,%.2lf)\n", x1, y1, x2, y2);
+	fprintf(picture, "DR(%.2lf,%.2lf,%.2lf,%.2lf)\n", x1, y1, x2, y2);
 }
 
 /*	A dot centered at (x, y) with radius r is drawn. The unit of the
@@ -71,7 +75,7 @@ void DrawRect( double x1, double y1, double x2, double y2)
 
 void DrawDot(double x, double y, int r)
 {
-	printf("DD(%.2lf,%.2lf,%d)\n", x, y, r);
+	fprintf(picture, "DD(%.2lf,%.2lf,%d)\n", x, y, r);
 }
 
 /*	Draws a character, with the left side and base line of coordinate
@@ -81,7 +85,7 @@ void DrawDot(double x, double y, int r)
 
 void DrawChar(char c, double x, double y)
 {
-	printf("DC(%c,%.2lf,%.2lf)\n", c, x, y);
+	fprintf(picture, "DC(%c,%.2lf,%.2lf)\n", c, x, y);
 }
 
 /*	Draws a name, with the left side and base line of the
@@ -95,6 +99,6 @@ void DrawChar(char c, double x, double y)
 
 void DrawName(char *n, double x, double y)
 {
-	printf("DN(%s,%.2lf,%.2lf)\n", n, x, y);
+	fprintf(picture, "DN(%s,%.2lf,%.2lf)\n", n, x, y);
 }
 
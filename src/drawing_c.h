@@ -7,15 +7,18 @@
 	A C/C++ include file, implementing drawing primitives.
 */
 
+#include <stdio.h>
+
 
 /*	Starts a new picture. This routine must be called before any
 	other drawing routines are called. The size of the picture
 	is assumed to be lx * ly, with the origin (0,0) in the lower
 	left corner. You can draw outside of the boundary of the
-	picture area, but it may not be displayed or printed.
+	picture area, but it may not be displayed or printed. The
+	picture is printed to out.
 	Output: $$$$ SP(lx,ly) */
 
-extern void StartPicture(double lx, double ly);
+extern void StartPicture(FILE *out, double lx, double ly);
 
 /*	Marks the end of the current picture. After this call, no
 	drawing routine other than StartPicture may be called.
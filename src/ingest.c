@@ -0,0 +1,201 @@
+#include <sched.h>
+#include <string.h>
+
+#include "ingest.h"
+
+/*
+	ingest.c
+
+	The ring follows the bounded queue of D. Vyukov. Every slot carries a
+	sequence number: a slot at position pos is free for a producer when its
+	sequence equals pos, and holds a command for the writer when it equals
+	pos + 1. Producers claim positions with a compare-and-swap on tail; the
+	single writer needs no atomic read-modify-write on head.
+
+	A thread about to sleep first announces it in one of the sleeping,
+	blocked or waiting counters and then looks at the ring once more; the
+	thread that changes the ring makes its change and then reads the
+	counter. The fences between the two steps on each side guarantee that
+	one of them sees the other, so a wakeup is never lost, and the mutex
+	held from the announcement to the wait makes the signal arrive after it.
+*/
+
+static int ingest_pop(ingest_ring_t *ring, command_t *command) {
+	ingest_slot_t *slot = &ring->slot[ring->head & (INGEST_RING_SIZE - 1)];
+
+	if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != ring->head + 1)
+		return 0;
+
+	*command = slot->command;
+	atomic_store_explicit(&slot->sequence, ring->head + INGEST_RING_SIZE, memory_order_release);
+	ring->head++;
+	return 1;
+}
+
+static void ingest_signal(ingest_ring_t *ring, atomic_int *sleepers, pthread_cond_t *cond) {
+	/*
+	** Wakes the threads sleeping on cond after the caller changed what they wait for
+	*/
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(sleepers, memory_order_relaxed) == 0)
+		return;
+	pthread_mutex_lock(&ring->lock);
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void ingest_sleep(ingest_ring_t *ring) {
+	/*
+	** Puts the writer to sleep until a command is pushed or the ring stops
+	*/
+	ingest_slot_t *slot = &ring->slot[ring->head & (INGEST_RING_SIZE - 1)];
+
+	pthread_mutex_lock(&ring->lock);
+	atomic_store_explicit(&ring->sleeping, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	while ((atomic_load_explicit(&slot->sequence, memory_order_acquire) != ring->head + 1)
+		&& !atomic_load_explicit(&ring->stopping, memory_order_acquire))
+		pthread_cond_wait(&ring->ready, &ring->lock);
+	atomic_store_explicit(&ring->sleeping, 0, memory_order_relaxed);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void *ingest_writer(void *arg) {
+	ingest_ring_t *ring = arg;
+	command_t batch[INGEST_BATCH_SIZE];
+	int i, n, stopping, drained = 1, idle = 0;
+
+	while (1) {
+		// Read the flag before draining, so that nothing pushed before the stop is missed
+		stopping = atomic_load_explicit(&ring->stopping, memory_order_acquire);
+
+		for (n = 0; (n < INGEST_BATCH_SIZE) && ingest_pop(ring, &batch[n]); n++)
+			;
+
+		if (n == 0) {
+			if (!drained) {
+				ring->apply(batch, 0);
+				drained = 1;
+			}
+			if (stopping)
+				return NULL;
+			if (++idle < INGEST_SPIN)
+				sched_yield();
+			else {
+				ingest_sleep(ring);
+				idle = 0;
+			}
+			continue;
+		}
+
+		idle = 0;
+		ingest_signal(ring, &ring->blocked, &ring->space);
+		ring->apply(batch, n);
+		drained = 0;
+		for (i = 0; i < n; i++)
+			if (batch[i].completion != NULL) {
+				atomic_store_explicit(&batch[i].completion->done, 1, memory_order_release);
+				ingest_signal(ring, &ring->waiting, &ring->replied);
+			}
+	}
+}
+
+void ingest_start(ingest_ring_t *ring, ingest_apply_t apply) {
+	size_t i;
+
+	for (i = 0; i < INGEST_RING_SIZE; i++)
+		atomic_init(&ring->slot[i].sequence, i);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->stopping, 0);
+	atomic_init(&ring->sleeping, 0);
+	atomic_init(&ring->blocked, 0);
+	atomic_init(&ring->waiting, 0);
+	ring->head = 0;
+	ring->apply = apply;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->ready, NULL);
+	pthread_cond_init(&ring->space, NULL);
+	pthread_cond_init(&ring->replied, NULL);
+
+	pthread_create(&ring->writer, NULL, ingest_writer, ring);
+}
+
+static int ingest_claim(ingest_ring_t *ring, command_t *command) {
+	/*
+	** Copies command into the ring, without waking the writer
+	*/
+	ingest_slot_t *slot;
+	size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t sequence;
+
+	while (1) {
+		slot = &ring->slot[pos & (INGEST_RING_SIZE - 1)];
+		sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+		if (sequence == pos) {
+			if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (sequence < pos)
+			return 0; // the writer has not consumed this slot's previous command yet
+		else
+			pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	}
+
+	slot->command = *command;
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+	return 1;
+}
+
+int ingest_try_push(ingest_ring_t *ring, command_t *command) {
+	if (!ingest_claim(ring, command))
+		return 0;
+	ingest_signal(ring, &ring->sleeping, &ring->ready);
+	return 1;
+}
+
+void ingest_push(ingest_ring_t *ring, command_t *command) {
+	int tries;
+
+	for (tries = 0; tries < INGEST_SPIN; tries++) {
+		if (ingest_try_push(ring, command))
+			return;
+		sched_yield();
+	}
+
+	// The writer is woken once the lock is released, as it sleeps under the same lock
+	pthread_mutex_lock(&ring->lock);
+	atomic_fetch_add_explicit(&ring->blocked, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	while (!ingest_claim(ring, command))
+		pthread_cond_wait(&ring->space, &ring->lock);
+	atomic_fetch_sub_explicit(&ring->blocked, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&ring->lock);
+	ingest_signal(ring, &ring->sleeping, &ring->ready);
+}
+
+void ingest_wait(ingest_ring_t *ring, completion_t *completion) {
+	int tries;
+
+	for (tries = 0; tries < INGEST_SPIN; tries++) {
+		if (atomic_load_explicit(&completion->done, memory_order_acquire))
+			return;
+		sched_yield();
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	atomic_fetch_add_explicit(&ring->waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	while (!atomic_load_explicit(&completion->done, memory_order_acquire))
+		pthread_cond_wait(&ring->replied, &ring->lock);
+	atomic_fetch_sub_explicit(&ring->waiting, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+void ingest_stop(ingest_ring_t *ring) {
+	atomic_store_explicit(&ring->stopping, 1, memory_order_release);
+	pthread_mutex_lock(&ring->lock);
+	pthread_cond_broadcast(&ring->ready);
+	pthread_mutex_unlock(&ring->lock);
+	pthread_join(ring->writer, NULL);
+}
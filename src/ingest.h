@@ -0,0 +1,86 @@
+#ifndef INGEST_H_
+#define INGEST_H_
+
+/*
+	ingest.h
+
+	Bounded lock-free ring of parsed commands. Any number of producer threads
+	push commands; a single writer thread drains them in batches and hands each
+	batch to the apply routine, which is the only code that touches the
+	MX-CIF quadtree. Threads that find nothing to do spin for a little while
+	and then sleep until they are signalled, so an idle ring costs no CPU.
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "quadtree.h"
+
+#define INGEST_RING_SIZE 1024 //Slots in the ring, a power of 2
+#define INGEST_BATCH_SIZE 64 //Most commands handed to the apply routine at once
+#define INGEST_SPIN 64 //Times a thread yields before it goes to sleep waiting on the ring
+
+typedef struct {
+	atomic_int done; //Set by the writer once the command has been applied
+	char *reply; //Output of the command, malloc'ed by the apply routine
+	size_t len;
+} completion_t; //Slot through which the reply to a command goes back to its producer
+
+typedef struct {
+	char name[MAX_STRING_LEN]; //Command name, e.g. "INSERT"
+	char args[MAX_ARGS][MAX_NAME_LEN + 1]; //Arguments, unused ones are empty strings
+	completion_t *completion; //Signalled after the command is applied, may be NULL
+	int latency; //Histogram of the command in the latency table, -1 for none
+	char *malformed; //Why the line of the command was rejected, NULL for a command read well
+} command_t;
+
+typedef struct {
+	atomic_size_t sequence; //Position the slot is ready for, see ingest.c
+	command_t command;
+} ingest_slot_t;
+
+typedef void (*ingest_apply_t)(command_t *batch, int n);
+
+typedef struct {
+	ingest_slot_t slot[INGEST_RING_SIZE];
+	_Alignas(64) atomic_size_t tail; //Next position claimed by a producer
+	_Alignas(64) size_t head; //Next position read by the writer
+	atomic_int stopping; //Set once no more commands will be pushed
+	ingest_apply_t apply; //Runs on the writer thread for every batch
+	pthread_t writer;
+	pthread_mutex_t lock; //Guards the sleeps below
+	pthread_cond_t ready; //Signalled when the writer sleeps and a command is pushed, or the ring stops
+	pthread_cond_t space; //Signalled when a producer sleeps and the writer frees slots
+	pthread_cond_t replied; //Signalled when a producer sleeps and a completion is set
+	atomic_int sleeping; //Set while the writer sleeps on ready
+	atomic_int blocked; //Producers sleeping on space
+	atomic_int waiting; //Producers sleeping on replied
+} ingest_ring_t;
+
+/*	Initializes ring and starts its writer thread, which calls apply with
+	the commands in the order they were pushed. Each time the ring runs
+	empty after some commands, apply is also called with no commands. */
+
+extern void ingest_start(ingest_ring_t *ring, ingest_apply_t apply);
+
+/*	Copies command into the ring. Returns 0 without blocking if the ring
+	is full. Safe to call from several threads at once. */
+
+extern int ingest_try_push(ingest_ring_t *ring, command_t *command);
+
+/*	Same as ingest_try_push, but waits for the writer while the ring is full. */
+
+extern void ingest_push(ingest_ring_t *ring, command_t *command);
+
+/*	Waits until the writer of ring has applied the command that carried
+	completion, whose reply is then ready. */
+
+extern void ingest_wait(ingest_ring_t *ring, completion_t *completion);
+
+/*	Lets the writer apply everything pushed so far, then joins it. Every
+	producer must have finished pushing before this is called. */
+
+extern void ingest_stop(ingest_ring_t *ring);
+
+#endif /* INGEST_H_ */
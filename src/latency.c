@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+
+/*
+	latency.c
+
+	A time t of at least 2^LATENCY_SUB_BITS ticks goes to the bucket given by
+	the position of its highest bit and the LATENCY_SUB_BITS bits below it;
+	smaller times have a bucket each. Reported times are the highest time a
+	bucket can hold, so that a percentile is never understated.
+*/
+
+static int latency_bucket(unsigned long ticks) {
+	int e;
+
+	if (ticks < (1UL << LATENCY_SUB_BITS))
+		return ticks;
+	e = 63 - __builtin_clzl(ticks);
+	if (e >= LATENCY_MAX_BITS)
+		return LATENCY_BUCKETS - 1;
+	return ((e - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + ((ticks >> (e - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+static unsigned long latency_bucket_top(int b) {
+	int e;
+
+	if (b < (1 << LATENCY_SUB_BITS))
+		return b;
+	e = (b >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+	return (((unsigned long)((1 << LATENCY_SUB_BITS) + (b & ((1 << LATENCY_SUB_BITS) - 1))) + 1) << (e - LATENCY_SUB_BITS)) - 1;
+}
+
+static double ticks_per_usec(latency_table_t *table) {
+	struct timespec now;
+	unsigned long ticks = latency_ticks();
+	double usec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - table->start_time.tv_sec) * 1e6 + (now.tv_nsec - table->start_time.tv_nsec) / 1e3;
+	return (usec > 0) ? (ticks - table->start_ticks) / usec : 1;
+}
+
+int latency_kind(latency_table_t *table, char *name) {
+	/*
+	** Histograms are claimed under the lock and never given up, so a histogram found in
+	** use can be compared without it. The hash only mixes the first 16 bytes of the name,
+	** which tell the command names apart well enough.
+	*/
+	unsigned long word[2] = {0, 0};
+	size_t len = strnlen(name, LATENCY_NAME_LEN);
+	latency_histogram_t *h;
+	unsigned int hash;
+	int i, k;
+
+	if (len == LATENCY_NAME_LEN)
+		return -1;
+	memcpy(word, name, len < sizeof(word) ? len : sizeof(word));
+	hash = ((word[0] ^ (word[1] * 0x9e3779b97f4a7c15UL)) * 0xff51afd7ed558ccdUL) >> 40;
+
+	for (i = 0; i < LATENCY_KINDS; i++) {
+		k = (hash + i) & (LATENCY_KINDS - 1);
+		h = &table->kind[k];
+		if (!atomic_load_explicit(&h->used, memory_order_acquire)) {
+			pthread_mutex_lock(&table->lock);
+			if (!atomic_load_explicit(&h->used, memory_order_relaxed)) {
+				strcpy(h->name, name);
+				atomic_store_explicit(&h->used, 1, memory_order_release);
+			}
+			pthread_mutex_unlock(&table->lock);
+		}
+		if (strcmp(h->name, name) == 0)
+			return k;
+	}
+	return -1;
+}
+
+void latency_start(latency_table_t *table, double slow_usec, FILE *slow_log) {
+	struct timespec pause = {0, 10000000};
+	int k;
+
+	for (k = 0; k < LATENCY_KINDS; k++) {
+		atomic_init(&table->kind[k].used, 0);
+		table->kind[k].count = 0;
+		table->kind[k].max = 0;
+		memset(table->kind[k].bucket, 0, sizeof(table->kind[k].bucket));
+	}
+	pthread_mutex_init(&table->lock, NULL);
+	table->recording = 1;
+	table->slow_log = slow_log;
+	table->slow_ticks = 0;
+	table->start_ticks = latency_ticks();
+	clock_gettime(CLOCK_MONOTONIC, &table->start_time);
+
+	// The threshold is kept in ticks, so the clock rate is measured over a short pause
+	if (slow_usec > 0) {
+		nanosleep(&pause, NULL);
+		table->slow_ticks = slow_usec * ticks_per_usec(table);
+		if (table->slow_ticks == 0)
+			table->slow_ticks = 1;
+	}
+}
+
+int latency_record(latency_table_t *table, command_t *command, int n, unsigned long ticks, unsigned long nodes) {
+	latency_histogram_t *h = (command->latency >= 0) ? &table->kind[command->latency] : NULL;
+	unsigned long share = (n == 1) ? ticks : ticks / n;
+	double usec;
+	int i, a;
+
+	if (h != NULL) {
+		h->count += n;
+		h->bucket[latency_bucket(share)] += n;
+		if (share > h->max)
+			h->max = share;
+	}
+
+	if ((table->slow_ticks == 0) || (share <= table->slow_ticks))
+		return 0;
+	usec = share / ticks_per_usec(table);
+	for (i = 0; i < n; i++) {
+		fprintf(table->slow_log, "SLOW COMMAND %s(", command[i].name);
+		for (a = 0; (a < MAX_ARGS) && (command[i].args[a][0] != '\0'); a++)
+			fprintf(table->slow_log, "%s%s", a > 0 ? "," : "", command[i].args[a]);
+		fprintf(table->slow_log, ") TOOK %.1f US AND VISITED %lu NODES\n", usec, nodes / n);
+	}
+	fflush(table->slow_log);
+	return 1;
+}
+
+static int latency_name_compare(const void *a, const void *b) {
+	return strcmp((*(latency_histogram_t * const *)a)->name, (*(latency_histogram_t * const *)b)->name);
+}
+
+void latency_report(latency_table_t *table, FILE *out) {
+	static const double percentile[] = {50, 90, 99, 99.9};
+	latency_histogram_t *used[LATENCY_KINDS], *h;
+	double rate = ticks_per_usec(table);
+	unsigned long seen, rank, top;
+	int n = 0, i, p, b;
+
+	for (i = 0; i < LATENCY_KINDS; i++)
+		if (table->kind[i].count > 0)
+			used[n++] = &table->kind[i];
+	if (n == 0) {
+		fprintf(out, "NO COMMAND LATENCIES RECORDED\n");
+		return;
+	}
+	qsort(used, n, sizeof(latency_histogram_t *), latency_name_compare);
+
+	for (i = 0; i < n; i++) {
+		h = used[i];
+		fprintf(out, "LATENCY OF %s: %lu COMMANDS,", h->name, h->count);
+		seen = 0;
+		b = 0;
+		for (p = 0; p < 4; p++) {
+			// The smallest time at or below which the given share of the commands took
+			rank = (unsigned long)(percentile[p] / 100 * h->count + 0.999999);
+			if (rank == 0)
+				rank = 1;
+			while (seen + h->bucket[b] < rank)
+				seen += h->bucket[b++];
+			top = latency_bucket_top(b);
+			fprintf(out, " P%g %.1f US,", percentile[p], (top < h->max ? top : h->max) / rate);
+		}
+		fprintf(out, " MAX %.1f US\n", h->max / rate);
+	}
+}
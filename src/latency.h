@@ -0,0 +1,81 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+/*
+	latency.h
+
+	Latency histograms of the commands, one per command name, and a log of
+	the commands slower than a threshold. The histograms have the log-linear
+	buckets of an HDR histogram: every power of 2 is cut into the same number
+	of buckets, so any time is kept to within 1/16 of its value. Times are
+	read from the processor's cycle counter where there is one, and only
+	converted to microseconds when they are reported.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ingest.h"
+
+#define LATENCY_SUB_BITS 4 //Every power of 2 is cut into 2^LATENCY_SUB_BITS buckets
+#define LATENCY_MAX_BITS 48 //Times of 2^48 ticks or more share the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define LATENCY_KINDS 64 //Most command names told apart, a power of 2
+#define LATENCY_NAME_LEN 40 //Longest command name told apart, plus one
+
+typedef struct {
+	atomic_int used; //Set once name is filled in
+	char name[LATENCY_NAME_LEN]; //Command name
+	unsigned long count;
+	unsigned long max; //Longest time, in ticks
+	unsigned long bucket[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+typedef struct {
+	latency_histogram_t kind[LATENCY_KINDS]; //Open addressing on a hash of the name
+	pthread_mutex_t lock; //Taken to claim an unused histogram
+	int recording; //Set while the commands are timed
+	FILE *slow_log; //Where the slow commands are logged
+	unsigned long slow_ticks; //Commands taking longer are logged, none when 0
+	unsigned long start_ticks; //Clock readings when the table was started, to convert ticks to time
+	struct timespec start_time;
+} latency_table_t;
+
+/*	Reads the clock the latencies are measured with. */
+
+static inline unsigned long latency_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+#endif
+}
+
+/*	Clears table. Commands taking more than slow_usec microseconds are
+	logged to slow_log, unless slow_usec is 0. */
+
+extern void latency_start(latency_table_t *table, double slow_usec, FILE *slow_log);
+
+/*	Returns the histogram of the commands called name, to be kept in their
+	latency field, or -1 if they go unrecorded because the name is too long
+	or the table is full. Safe to call from several threads at once. */
+
+extern int latency_kind(latency_table_t *table, char *name);
+
+/*	Records that the n commands starting at command, which share a name,
+	took ticks altogether and visited nodes quadtree and axis nodes.
+	Commands applied together are each charged an equal share. Returns 1 if
+	they were logged as slow. */
+
+extern int latency_record(latency_table_t *table, command_t *command, int n, unsigned long ticks, unsigned long nodes);
+
+/*	Prints the count and the percentiles of every command name to out. */
+
+extern void latency_report(latency_table_t *table, FILE *out);
+
+#endif /* LATENCY_H_ */
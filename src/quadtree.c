@@ -1,52 +1,235 @@
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "quadtree.h"
 #include "drawing_c.h"
+#include "ingest.h"
+#include "shard.h"
+#include "bulk.h"
+#include "latency.h"
+#include "server.h"
 
 struct mxcif *mx_cif_tree; //MX-CIF Quadtree
-bnode_t *rect_tree; //Rectangle bin tree, sorted with respect to rect names
+ref_t rect_tree; //Rectangle bin tree, sorted with respect to rect names
+cursor_t window_cursor; //Cursor of the last WINDOW query, resumed by FETCH
+query_cache_t query_cache; //Results of recent point, rectangle and window queries
+unsigned long mutation_stamp; //Bumped by every change to the MX-CIF quadtree
+ingest_ring_t ingest_ring; //Parsed commands waiting for the writer thread
+shard_router_t shard_router; //Worker processes of a sharded quadtree
+reply_t shard_reply[MAX_SHARDS]; //Last reply of each worker
+command_t routed_queue[SHARD_PIPELINE]; //Commands sent to the workers whose replies are not read yet
+unsigned long routed_workers[SHARD_PIPELINE]; //Workers each queued command was sent to
+unsigned long routed_ticks[SHARD_PIPELINE]; //When each queued command was sent
+int routed_commands;
+pool_t cnode_pool = {sizeof(cnode_t)}; //Quadtree nodes
+pool_t bnode_pool = {sizeof(bnode_t)}; //Axis tree nodes
+pool_t rect_pool = {sizeof(rectangle_t)}; //Created and moved rectangles
+name_pool_t name_pool; //Names of the created rectangles
+int pinned_versions; //Versions of the quadtree held by readers besides the current one
+bulk_pool_t query_pool; //Threads running read-only queries, see flush_queries
+command_t query_queue[QUERY_QUEUE_SIZE]; //Read-only queries not run yet
+int queued_queries;
+int queries_in_parallel; //Set while query_pool runs queries, which must not touch the cache
+int query_cached[QUERY_QUEUE_SIZE]; //Whether each queued query is answered from the cache
+int query_entry[QUERY_QUEUE_SIZE]; //Cache entry stored for each queued query, -1 for none
+rectangle_t *query_result[QUERY_QUEUE_SIZE]; //Result of each queued query
+unsigned long query_ticks[QUERY_QUEUE_SIZE]; //Time taken by each query run in parallel
+unsigned long query_nodes[QUERY_QUEUE_SIZE]; //Nodes visited by each query run in parallel
+latency_table_t latencies; //Time taken by the commands, see LATENCY()
+server_t server; //Clients connected through a Unix socket
+FILE *trace_out; //Reply of the command being applied, where tracing prints the nodes visited
+__thread unsigned long nodes_visited; //Quadtree and axis nodes visited by the current command
+__thread int current_query; //Index in query_queue of the query run by a query thread
 
 const double DISPLAY_SIZE = 128;
 double scale_factor;
 int trace = 0;
 
-static bnode_t *find_btree(bnode_t *tree, bnode_t *node);
-static void traverse_bintree(bnode_t *node);
-static void traverse_quadtree(cnode_t *node);
-static rectangle_t *cross_axis(rectangle_t *P, bnode_t *R, int Cv, int Lv, axis V, int *bin_node_number);
-static int rect_intersect(rectangle_t *P, int Cx, int Cy, int Lx, int Ly);
-static rectangle_t *cif_search(rectangle_t *P, cnode_t *R, int Cx, int Cy, int Lx, int Ly, int *quad_node_number);
-static void delete_from_btree(bnode_t **node);
+static ref_t find_btree(ref_t tree, char *name);
+static void traverse_bintree(FILE *out, ref_t node);
+static void traverse_quadtree(FILE *out, ref_t node);
+static rectangle_t *cross_axis(rectangle_t *P, ref_t R, int Cv, int Lv, axis V, int *bin_node_number);
+static inline int rect_intersect(rectangle_t *P, int Cx, int Cy, int Lx, int Ly);
+static rectangle_t *cif_search(rectangle_t *P, ref_t R, int Cx, int Cy, int Lx, int Ly, int *quad_node_number);
+static void delete_from_btree(ref_t *node);
 
 static void init_mx_cif_tree(void) {
 	mx_cif_tree = (struct mxcif *)malloc(sizeof(struct mxcif));
-	mx_cif_tree->mx_cif_root = NULL;
+	mx_cif_tree->mx_cif_root = 0;
 	mx_cif_tree->world.rect_name = "MX-CIF";
 }
 
 static void init_rect_tree(void) {
-	 rect_tree = NULL;
+	 rect_tree = 0;
  }
 
-static void print_in_order(bnode_t *node) {
-	if (node != NULL) {
-		print_in_order(node->bson[LEFT]);
-		printf("%s(%d,%d,%d,%d) ", node->rect->rect_name, node->rect->center[X], node->rect->center[Y], node->rect->lenght[X], node->rect->lenght[Y]);
-		print_in_order(node->bson[RIGHT]);
+/*
+** Nodes and rectangles live in pools and link to each other by 32-bit index instead of by
+** pointer, which halves the size of a node. Fields that only some queries need (the
+** subtree summaries, the link counts of shared nodes and the stamps of the query cache)
+** are columns kept apart from the objects, allocated only while they are in use.
+*/
+
+static inline void *pool_at(pool_t *pool, ref_t i) {
+	return pool->block[i >> POOL_SHIFT] + (i & (POOL_BLOCK - 1)) * pool->size;
+}
+
+static inline cnode_t *cnode_at(ref_t i) {
+	return (cnode_t *)cnode_pool.block[i >> POOL_SHIFT] + (i & (POOL_BLOCK - 1));
+}
+
+static inline bnode_t *bnode_at(ref_t i) {
+	return (bnode_t *)bnode_pool.block[i >> POOL_SHIFT] + (i & (POOL_BLOCK - 1));
+}
+
+static inline rectangle_t *rect_at(ref_t i) {
+	return (rectangle_t *)rect_pool.block[i >> POOL_SHIFT] + (i & (POOL_BLOCK - 1));
+}
+
+static inline int column_kept(pool_t *pool, column_kind c) {
+	return pool->column[c].size != 0;
+}
+
+static inline void *column_at(pool_t *pool, column_kind c, ref_t i) {
+	return pool->column[c].block[i >> POOL_SHIFT] + (i & (POOL_BLOCK - 1)) * pool->column[c].size;
+}
+
+static void column_keep(pool_t *pool, column_kind c, size_t size) {
+	/*
+	** Starts keeping column c for the objects of pool, with every value zero
+	*/
+	column_t *col = &pool->column[c];
+	int b;
+
+	if (col->size != 0)
+		return;
+	col->size = size;
+	col->block = (char **)malloc((pool->cap > 0 ? pool->cap : 1) * sizeof(char *));
+	for (b = 0; b < pool->blocks; b++)
+		col->block[b] = (char *)calloc(POOL_BLOCK, size);
+}
+
+static void column_drop(pool_t *pool, column_kind c) {
+	column_t *col = &pool->column[c];
+	int b;
+
+	if (col->size == 0)
+		return;
+	for (b = 0; b < pool->blocks; b++)
+		free(col->block[b]);
+	free(col->block);
+	col->block = NULL;
+	col->size = 0;
+}
+
+static void pool_grow(pool_t *pool) {
+	int c;
+
+	if (pool->blocks == pool->cap) {
+		pool->cap = (pool->cap == 0) ? 16 : 2 * pool->cap;
+		pool->block = (char **)realloc(pool->block, pool->cap * sizeof(char *));
+		for (c = 0; c < POOL_COLUMNS; c++)
+			if (column_kept(pool, c))
+				pool->column[c].block = (char **)realloc(pool->column[c].block, pool->cap * sizeof(char *));
+	}
+
+	pool->block[pool->blocks] = (char *)malloc(POOL_BLOCK * pool->size);
+	for (c = 0; c < POOL_COLUMNS; c++)
+		if (column_kept(pool, c))
+			pool->column[c].block[pool->blocks] = (char *)calloc(POOL_BLOCK, pool->column[c].size);
+	if (pool->blocks++ == 0)
+		pool->carved = 1; // index 0 stands for no object
+}
+
+static ref_t pool_alloc(pool_t *pool) {
+	/*
+	** Nodes are small and numerous, so they are carved from large blocks instead of being
+	** malloc'ed one by one, which costs a header and rounding per node. The columns kept
+	** for the object start out zero.
+	*/
+	ref_t i = pool->free_list;
+	int c;
+
+	if (i != 0)
+		pool->free_list = *(ref_t *)pool_at(pool, i);
+	else {
+		if (pool->carved == ((ref_t)pool->blocks << POOL_SHIFT))
+			pool_grow(pool);
+		i = pool->carved++;
 	}
+	for (c = 0; c < POOL_COLUMNS; c++)
+		if (column_kept(pool, c))
+			memset(column_at(pool, c, i), 0, pool->column[c].size);
+	pool->live++;
+	return i;
 }
 
-static void print_pre_order(bnode_t *node) {
-	if (node != NULL) {
-		printf("%s", node->rect->rect_name);
-		print_pre_order(node->bson[LEFT]);
-		print_pre_order(node->bson[RIGHT]);
+static void pool_free(pool_t *pool, ref_t i) {
+	*(ref_t *)pool_at(pool, i) = pool->free_list;
+	pool->free_list = i;
+	pool->live--;
+}
+
+static char *pool_name(char *name) {
+	size_t len = strlen(name) + 1;
+
+	if ((name_pool.block == NULL) || (name_pool.used + len > NAME_POOL_BLOCK)) {
+		name_pool.block = (char *)malloc(NAME_POOL_BLOCK);
+		name_pool.used = 0;
+	}
+	memcpy(name_pool.block + name_pool.used, name, len);
+	name_pool.used += len;
+	name_pool.bytes += len;
+	return name_pool.block + name_pool.used - len;
+}
+
+static void print_rectangle(FILE *out, rectangle_t *rect) {
+	fprintf(out, "%s(%d,%d,%d,%d) ", rect->rect_name, rect->center[X], rect->center[Y], rect->lenght[X], rect->lenght[Y]);
+}
+
+static void walk_in_order(FILE *out, ref_t node, void (*visit)(FILE *, rectangle_t *)) {
+	/*
+	** Morris in-order traversal: the name tree is not balanced (sorted input degenerates into
+	** a list), so instead of a stack each left subtree temporarily threads its rightmost node
+	** back to its parent. The threads are removed on the way out, leaving the tree unchanged.
+	*/
+	rectangle_t *N, *pred;
+
+	while (node != 0) {
+		N = rect_at(node);
+		if (N->bson[LEFT] == 0) {
+			visit(out, N);
+			node = N->bson[RIGHT];
+			continue;
+		}
+
+		pred = rect_at(N->bson[LEFT]);
+		while ((pred->bson[RIGHT] != 0) && (pred->bson[RIGHT] != node))
+			pred = rect_at(pred->bson[RIGHT]);
+
+		if (pred->bson[RIGHT] == 0) {
+			pred->bson[RIGHT] = node;
+			node = N->bson[LEFT];
+		} else {
+			pred->bson[RIGHT] = 0;
+			visit(out, N);
+			node = N->bson[RIGHT];
+		}
+	}
+}
+
+static void print_pre_order(FILE *out, ref_t node) {
+	if (node != 0) {
+		fprintf(out, "%s", rect_at(node)->rect_name);
+		print_pre_order(out, rect_at(node)->bson[LEFT]);
+		print_pre_order(out, rect_at(node)->bson[RIGHT]);
 	}
 }
 
-static direction bin_compare(rectangle_t *P, long Cv, axis V) {
+static inline direction bin_compare(rectangle_t *P, long Cv, axis V) {
 	/*
 	** Determines whether rectangle P lies to the left of, right of, or contains line V=Cv
 	*/
@@ -58,7 +241,7 @@ static direction bin_compare(rectangle_t *P, long Cv, axis V) {
 		return LEFT;
 }
 
-static quadrant cif_compare(rectangle_t *P, int Cx, int Cy) {
+static inline quadrant cif_compare(rectangle_t *P, int Cx, int Cy) {
 	/*
 	** Return the quadrant of the MX-CIF quadtree rooted at position (Cx,Cy) that contains
 	** the centroid of rectangle P
@@ -76,73 +259,499 @@ static quadrant cif_compare(rectangle_t *P, int Cx, int Cy) {
 			return NE;
 }
 
-static bnode_t *create_bnode(void) {
-	bnode_t *node = (bnode_t *)malloc(sizeof(bnode_t));
-	node->rect = NULL;
-	node->bson[X] = node->bson[Y] = NULL;
+static inline unsigned long long morton_interleave(unsigned int x, unsigned int y) {
+	/*
+	** Spreads the bits of x to the even positions and those of y to the odd ones
+	*/
+	unsigned long long v[NDIR_1D] = {x, y};
+	int V;
+
+	for (V = X; V <= Y; V++) {
+		v[V] = (v[V] | (v[V] << 16)) & 0x0000ffff0000ffffULL;
+		v[V] = (v[V] | (v[V] << 8)) & 0x00ff00ff00ff00ffULL;
+		v[V] = (v[V] | (v[V] << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		v[V] = (v[V] | (v[V] << 2)) & 0x3333333333333333ULL;
+		v[V] = (v[V] | (v[V] << 1)) & 0x5555555555555555ULL;
+	}
+	return v[X] | (v[Y] << 1);
+}
+
+static inline void descent_open(descent_t *path, rectangle_t *P, int Cx, int Cy, int Lx, int Ly) {
+	/*
+	** Prepares path for the descent cif_compare would guide from the square node centered
+	** at (Cx,Cy) towards the centroid of P. Relative to the corner of a square 2^levels
+	** wide, the centroid lies east of the center of the node d levels down exactly when
+	** bit levels-1-d of its x is set, and north of it when bit levels-1-d of its y is set,
+	** so interleaving x with the complement of y gives the quadrant of every level. The
+	** levels are 0 (step by step) when the square is not a power of 2 wide, when the
+	** centroid lies outside it, or while tracing, which numbers the nodes on the way.
+	*/
+	unsigned int x, y;
+
+	path->levels = 0;
+	path->key = 0;
+	if (trace || (Lx != Ly) || (Lx <= 0) || ((Lx & (Lx - 1)) != 0))
+		return;
+	path->corner[X] = Cx - Lx;
+	path->corner[Y] = Cy - Ly;
+	x = P->center[X] - path->corner[X];
+	y = P->center[Y] - path->corner[Y];
+	if ((P->center[X] < path->corner[X]) || (P->center[Y] < path->corner[Y]) || (x >= 2 * (unsigned int)Lx) || (y >= 2 * (unsigned int)Ly))
+		return;
+	path->levels = __builtin_ctz(Lx) + 1;
+	path->key = morton_interleave(x, ~y & (2 * (unsigned int)Ly - 1));
+}
+
+static inline quadrant descent_quadrant(descent_t *path, int depth) {
+	/*
+	** Quadrant taken depth levels below the start. Past the one-cell squares the centers
+	** no longer move, so the last quadrant repeats.
+	*/
+	if (depth >= path->levels)
+		depth = path->levels - 1;
+	return (quadrant)((path->key >> (2 * (path->levels - 1 - depth))) & 3);
+}
+
+static inline int descent_stop(descent_t *path, rectangle_t *P) {
+	/*
+	** Number of levels cif_insert descends before P meets an axis of the node reached, or
+	** -1 when P does not lie inside the square of path. Relative to the corner, the axis of
+	** the node d levels down is a multiple of 2^(levels-1-d), and P spans the cells lo to
+	** hi-1, which contain such a multiple exactly when lo-1 and hi-1 differ in bit
+	** levels-1-d or above. No axis lies at 0, so lo = 0 compares as 0.
+	*/
+	int V, lo, hi, depth, stop = path->levels;
+
+	for (V = X; V <= Y; V++) {
+		lo = P->center[V] - P->lenght[V] - path->corner[V];
+		hi = P->center[V] + P->lenght[V] - path->corner[V];
+		if ((P->lenght[V] < 1) || (lo < 0) || (hi > (1 << path->levels)))
+			return -1;
+		depth = path->levels - 32 + __builtin_clz((lo > 0 ? lo - 1 : 0) ^ (hi - 1));
+		if (depth < stop)
+			stop = depth;
+	}
+	return stop;
+}
+
+static inline void summary_add_rect(summary_t *sum, rectangle_t *P) {
+	int V;
+
+	for (V = X; V <= Y; V++) {
+		if ((sum->count == 0) || (P->center[V] - P->lenght[V] < sum->lo[V]))
+			sum->lo[V] = P->center[V] - P->lenght[V];
+		if ((sum->count == 0) || (P->center[V] + P->lenght[V] > sum->hi[V]))
+			sum->hi[V] = P->center[V] + P->lenght[V];
+	}
+	sum->area += (long)(2 * P->lenght[X]) * (2 * P->lenght[Y]);
+	sum->count++;
+}
+
+static inline void summary_merge(summary_t *sum, summary_t *son) {
+	int V;
+
+	if (son->count == 0)
+		return;
+	for (V = X; V <= Y; V++) {
+		if ((sum->count == 0) || (son->lo[V] < sum->lo[V]))
+			sum->lo[V] = son->lo[V];
+		if ((sum->count == 0) || (son->hi[V] > sum->hi[V]))
+			sum->hi[V] = son->hi[V];
+	}
+	sum->area += son->area;
+	sum->count += son->count;
+}
+
+static inline summary_t *cnode_sum(ref_t node) {
+	return (summary_t *)column_at(&cnode_pool, SUM_COLUMN, node);
+}
+
+static inline summary_t *bnode_sum(ref_t node) {
+	return (summary_t *)column_at(&bnode_pool, SUM_COLUMN, node);
+}
+
+static inline summary_t *node_sum(int is_axis, ref_t node) {
+	return is_axis ? bnode_sum(node) : cnode_sum(node);
+}
+
+static inline stamps_t *cnode_stamps(ref_t node) {
+	return (stamps_t *)column_at(&cnode_pool, STAMPS_COLUMN, node);
+}
+
+static inline int *node_shares(pool_t *pool, ref_t node) {
+	return (int *)column_at(pool, SHARES_COLUMN, node);
+}
+
+static inline int summaries_kept(void) {
+	return column_kept(&cnode_pool, SUM_COLUMN);
+}
+
+static void summarize_bnode(ref_t node) {
+	/*
+	** Recomputes the aggregate of node from its rectangle and the aggregates of its sons
+	*/
+	bnode_t *B = bnode_at(node);
+	summary_t *sum;
+	int D;
+
+	if (!summaries_kept())
+		return;
+	sum = bnode_sum(node);
+	sum->count = 0;
+	sum->area = 0;
+	if (B->rect != 0)
+		summary_add_rect(sum, rect_at(B->rect));
+	for (D = LEFT; D <= RIGHT; D++)
+		if (B->bson[D] != 0)
+			summary_merge(sum, bnode_sum(B->bson[D]));
+}
+
+static void summarize_cnode(ref_t node) {
+	cnode_t *C = cnode_at(node);
+	summary_t *sum;
+	int V, Q;
+
+	if (!summaries_kept())
+		return;
+	sum = cnode_sum(node);
+	sum->count = 0;
+	sum->area = 0;
+	for (V = X; V <= Y; V++)
+		if (C->bson[V] != 0)
+			summary_merge(sum, bnode_sum(C->bson[V]));
+	for (Q = NW; Q <= SE; Q++)
+		if (C->qson[Q] != 0)
+			summary_merge(sum, cnode_sum(C->qson[Q]));
+}
+
+static void keep_summaries(void) {
+	/*
+	** Starts keeping the aggregates on the nodes, for the queries that prune with them.
+	** The nodes of the current version are listed in pre-order, so summarizing them
+	** backwards reaches the sons before their parents.
+	*/
+	walk_frame_t stack[WALK_STACK_SIZE], *order;
+	long n = 0;
+	int top = 0, V, Q;
+
+	if (summaries_kept())
+		return;
+	column_keep(&cnode_pool, SUM_COLUMN, sizeof(summary_t));
+	column_keep(&bnode_pool, SUM_COLUMN, sizeof(summary_t));
+
+	order = (walk_frame_t *)malloc((cnode_pool.live + bnode_pool.live + 1) * sizeof(walk_frame_t));
+	if (mx_cif_tree->mx_cif_root != 0) {
+		stack[top].is_axis = 0;
+		stack[top++].node = mx_cif_tree->mx_cif_root;
+	}
+	while (top > 0) {
+		order[n++] = stack[--top];
+		if (stack[top].is_axis) {
+			bnode_t *B = bnode_at(stack[top].node);
+
+			for (V = LEFT; V <= RIGHT; V++)
+				if (B->bson[V] != 0) {
+					stack[top].is_axis = 1;
+					stack[top++].node = B->bson[V];
+				}
+		} else {
+			cnode_t *C = cnode_at(stack[top].node);
+
+			for (Q = NW; Q <= SE; Q++)
+				if (C->qson[Q] != 0) {
+					stack[top].is_axis = 0;
+					stack[top++].node = C->qson[Q];
+				}
+			for (V = Y; V >= X; V--)
+				if (C->bson[V] != 0) {
+					stack[top].is_axis = 1;
+					stack[top++].node = C->bson[V];
+				}
+		}
+	}
+
+	while (n > 0) {
+		n--;
+		if (order[n].is_axis)
+			summarize_bnode(order[n].node);
+		else
+			summarize_cnode(order[n].node);
+	}
+	free(order);
+}
+
+static inline void stamp_cnode(ref_t node, int own) {
+	/*
+	** Records on node that its subtree, and its axis trees when own is set, changed with
+	** the current mutation stamp
+	*/
+	stamps_t *stamps;
+
+	if (!column_kept(&cnode_pool, STAMPS_COLUMN))
+		return;
+	stamps = cnode_stamps(node);
+	stamps->version = mutation_stamp;
+	if (own)
+		stamps->own_version = mutation_stamp;
+}
+
+static ref_t create_bnode(void) {
+	ref_t node = pool_alloc(&bnode_pool);
+	bnode_t *B = bnode_at(node);
+
+	B->rect = 0;
+	B->bson[LEFT] = B->bson[RIGHT] = 0;
 	return node;
 }
 
-static cnode_t *create_cnode(void) {
-	cnode_t *node = (cnode_t *)malloc(sizeof(cnode_t));
-	node->qson[NW] = node->qson[NE] = node->qson[SW] = node->qson[SE] = NULL;
-	node->bson[X] = node->bson[Y] = NULL;
+static ref_t create_cnode(void) {
+	ref_t node = pool_alloc(&cnode_pool);
+	cnode_t *C = cnode_at(node);
+
+	C->qson[NW] = C->qson[NE] = C->qson[SW] = C->qson[SE] = 0;
+	C->bson[X] = C->bson[Y] = 0;
+	stamp_cnode(node, 1);
 	return node;
 }
 
-static void insert_axis(rectangle_t *P, cnode_t *R, int Cv, int Lv, axis V) {
-	bnode_t *T;
+/*
+** Nodes are shared between versions of the quadtree: an open WINDOW cursor pins the root
+** it pages through, and writers copy each shared node on their path before changing it
+** (path copying). DISPLAY and SPATIAL_JOIN run to completion on the writer thread, so
+** no mutation can land while they walk the tree; they read the current version unpinned
+** and still hold back the commands queued behind them.
+** While a version is pinned, the shares column counts the links to a node beyond the
+** first, so a node is private to the current version when it is 0 and is freed when it
+** loses its last link. With nothing pinned every node is private and the column is not
+** kept at all.
+*/
+
+static void column_copy(pool_t *pool, ref_t to, ref_t from) {
+	int c;
+
+	for (c = 0; c < POOL_COLUMNS; c++)
+		if ((c != SHARES_COLUMN) && column_kept(pool, c))
+			memcpy(column_at(pool, c, to), column_at(pool, c, from), pool->column[c].size);
+}
+
+static ref_t cow_bnode(ref_t *link) {
+	/*
+	** Makes *link private to the current version, copying it if it is shared, and returns it
+	*/
+	ref_t node = *link, copy;
+	bnode_t *B;
+	int D;
+
+	if ((node == 0) || !column_kept(&bnode_pool, SHARES_COLUMN) || (*node_shares(&bnode_pool, node) == 0))
+		return node;
+
+	copy = pool_alloc(&bnode_pool);
+	B = bnode_at(copy);
+	*B = *bnode_at(node);
+	column_copy(&bnode_pool, copy, node);
+	for (D = LEFT; D <= RIGHT; D++)
+		if (B->bson[D] != 0)
+			(*node_shares(&bnode_pool, B->bson[D]))++;
+	(*node_shares(&bnode_pool, node))--;
+	*link = copy;
+	return copy;
+}
+
+static ref_t cow_cnode(ref_t *link) {
+	ref_t node = *link, copy;
+	cnode_t *C;
+	int V, Q;
+
+	if ((node == 0) || !column_kept(&cnode_pool, SHARES_COLUMN) || (*node_shares(&cnode_pool, node) == 0))
+		return node;
+
+	copy = pool_alloc(&cnode_pool);
+	C = cnode_at(copy);
+	*C = *cnode_at(node);
+	column_copy(&cnode_pool, copy, node);
+	for (V = X; V <= Y; V++)
+		if (C->bson[V] != 0)
+			(*node_shares(&bnode_pool, C->bson[V]))++;
+	for (Q = NW; Q <= SE; Q++)
+		if (C->qson[Q] != 0)
+			(*node_shares(&cnode_pool, C->qson[Q]))++;
+	(*node_shares(&cnode_pool, node))--;
+	*link = copy;
+	return copy;
+}
+
+static void release_cnode(ref_t root) {
+	/*
+	** Drops one link to root, freeing every node that is no longer linked from anywhere
+	*/
+	walk_frame_t stack[WALK_STACK_SIZE];
+	int top = 0, V, Q, *shares;
+
+	if (root != 0) {
+		stack[top].is_axis = 0;
+		stack[top++].node = root;
+	}
+
+	while (top > 0) {
+		top--;
+		if (stack[top].is_axis) {
+			ref_t node = stack[top].node;
+			bnode_t *B = bnode_at(node);
+
+			shares = node_shares(&bnode_pool, node);
+			if (*shares > 0) {
+				(*shares)--;
+				continue;
+			}
+			for (V = LEFT; V <= RIGHT; V++)
+				if (B->bson[V] != 0) {
+					stack[top].is_axis = 1;
+					stack[top++].node = B->bson[V];
+				}
+			pool_free(&bnode_pool, node);
+		} else {
+			ref_t node = stack[top].node;
+			cnode_t *C = cnode_at(node);
+
+			shares = node_shares(&cnode_pool, node);
+			if (*shares > 0) {
+				(*shares)--;
+				continue;
+			}
+			for (Q = NW; Q <= SE; Q++)
+				if (C->qson[Q] != 0) {
+					stack[top].is_axis = 0;
+					stack[top++].node = C->qson[Q];
+				}
+			for (V = Y; V >= X; V--)
+				if (C->bson[V] != 0) {
+					stack[top].is_axis = 1;
+					stack[top++].node = C->bson[V];
+				}
+			pool_free(&cnode_pool, node);
+		}
+	}
+}
+
+static ref_t pin_version(void) {
+	/*
+	** Adds a link to the root of the current version, which writers then leave untouched
+	*/
+	ref_t root = mx_cif_tree->mx_cif_root;
+
+	if (root == 0)
+		return 0;
+	if (pinned_versions++ == 0) {
+		column_keep(&cnode_pool, SHARES_COLUMN, sizeof(int));
+		column_keep(&bnode_pool, SHARES_COLUMN, sizeof(int));
+	}
+	(*node_shares(&cnode_pool, root))++;
+	return root;
+}
+
+static void unpin_version(ref_t root) {
+	/*
+	** Drops the link of pin_version. Once no version is pinned, every node left is
+	** linked once and the shares column goes.
+	*/
+	if (root == 0)
+		return;
+	release_cnode(root);
+	if (--pinned_versions == 0) {
+		column_drop(&cnode_pool, SHARES_COLUMN);
+		column_drop(&bnode_pool, SHARES_COLUMN);
+	}
+}
+
+static void insert_axis(ref_t rect, ref_t R, int Cv, int Lv, axis V) {
+	rectangle_t *P = rect_at(rect);
+	ref_t T, *link;
+	ref_t path[MAX_DEPTH + 1];
 	int F[] = {-1, 1};
 	direction D;
-	int node_number = 0;
+	int node_number = 0, depth = 0;
 
 	if (trace)
-		printf("%d%c ", node_number, V == 0 ? 'X' : 'Y');
+		fprintf(trace_out, "%d%c ", node_number, V == 0 ? 'X' : 'Y');
 
-	if (R->bson[V] == NULL)
-		R->bson[V] = create_bnode();
+	link = &cnode_at(R)->bson[V];
+	if (*link == 0)
+		*link = create_bnode();
 
-	T = R->bson[V];
+	T = cow_bnode(link);
 	D = bin_compare(P, Cv, V);
 	while (D != BOTH) {
-		if (T->bson[D] == NULL)
-			T->bson[D] = create_bnode();
-		T = T->bson[D];
+		assert(depth < MAX_DEPTH);
+		path[depth++] = T;
+		link = &bnode_at(T)->bson[D];
+		if (*link == 0)
+			*link = create_bnode();
+		T = cow_bnode(link);
 		Lv = Lv / 2;
 		Cv = Cv + F[D] * Lv;
 		node_number = 2 * node_number + D + 1;
 		if (trace)
-			printf("%d%c ", node_number, V == 0 ? 'X' : 'Y');
+			fprintf(trace_out, "%d%c ", node_number, V == 0 ? 'X' : 'Y');
 		D = bin_compare(P, Cv, V);
 	}
-	T->rect = P;
+	bnode_at(T)->rect = rect;
+	nodes_visited += depth + 1;
+
+	// The aggregates are rebuilt from the sons, since P may have displaced an older rectangle
+	summarize_bnode(T);
+	while (depth > 0)
+		summarize_bnode(path[--depth]);
 }
 
-static void cif_insert(rectangle_t *P, struct mxcif *cif_tree, int Cx, int Cy, int Lx, int Ly) {
+static void cif_insert(ref_t rect, struct mxcif *cif_tree, int Cx, int Cy, int Lx, int Ly) {
 	int Sx[] = {-1, 1, -1, 1};
 	int Sy[] = {1, 1, -1, -1};
-	cnode_t *T;
+	rectangle_t *P = rect_at(rect);
+	ref_t T, *link;
 	quadrant Q;
 	direction Dx, Dy;
-	cnode_t *R;
-	int node_number = 0;
+	ref_t path[MAX_DEPTH + 1];
+	descent_t descent;
+	int node_number = 0, depth = 0, stop;
 
-	if (cif_tree->mx_cif_root == NULL)
+	if (cif_tree->mx_cif_root == 0)
 		cif_tree->mx_cif_root = create_cnode();
 
-	R = cif_tree->mx_cif_root;
-	T = R;
-	Dx = bin_compare(P, Cx, X);
-	Dy = bin_compare(P, Cy, Y);
+	T = cow_cnode(&cif_tree->mx_cif_root);
+	descent_open(&descent, P, Cx, Cy, Lx, Ly);
+	if ((descent.levels > 0) && ((stop = descent_stop(&descent, P)) >= 0)) {
+		// The whole path is known up front, so no comparison is made on the way down
+		for (; depth < stop; depth++) {
+			Q = descent_quadrant(&descent, depth);
+			path[depth] = T;
+			link = &cnode_at(T)->qson[Q];
+			if (*link == 0)
+				*link = create_cnode();
+			T = cow_cnode(link);
+		}
+		Lx = Lx >> stop;
+		Ly = Ly >> stop;
+		Cx = descent.corner[X] + ((P->center[X] - descent.corner[X]) & -(2 * Lx)) + Lx;
+		Cy = descent.corner[Y] + ((P->center[Y] - descent.corner[Y]) & -(2 * Ly)) + Ly;
+		Dx = bin_compare(P, Cx, X);
+		Dy = BOTH;
+	}
+	else {
+		Dx = bin_compare(P, Cx, X);
+		Dy = bin_compare(P, Cy, Y);
+	}
 
 	if (trace)
-		printf("%d ", node_number);
+		fprintf(trace_out, "%d ", node_number);
 
 	while ((Dx != BOTH) && (Dy != BOTH)) {
 		Q = cif_compare(P, Cx, Cy);
-		if (T->qson[Q] == NULL)
-			T->qson[Q] = create_cnode();
-		T = T->qson[Q];
+		assert(depth < MAX_DEPTH);
+		path[depth++] = T;
+		link = &cnode_at(T)->qson[Q];
+		if (*link == 0)
+			*link = create_cnode();
+		T = cow_cnode(link);
 		Lx = Lx / 2;
 		Ly = Ly / 2;
 		Cx = Cx + Sx[Q] * Lx;
@@ -151,50 +760,83 @@ static void cif_insert(rectangle_t *P, struct mxcif *cif_tree, int Cx, int Cy, i
 		Dy = bin_compare(P, Cy, Y);
 		node_number = 4 * node_number + Q + 1;
 		if (trace)
-			printf("%d ", node_number);
+			fprintf(trace_out, "%d ", node_number);
 	}
 
+	nodes_visited += depth + 1;
 	if (Dx == BOTH)
-		insert_axis(P, T, Cy, Ly, Y);
+		insert_axis(rect, T, Cy, Ly, Y);
 	else
-		insert_axis(P, T, Cx, Lx, X);
+		insert_axis(rect, T, Cx, Lx, X);
+
+	++mutation_stamp;
+	stamp_cnode(T, 1);
+	summarize_cnode(T);
+	while (depth > 0) {
+		T = path[--depth];
+		stamp_cnode(T, 0);
+		summarize_cnode(T);
+	}
 }
 
-static rectangle_t *cross_axis(rectangle_t *P, bnode_t *R, int Cv, int Lv, axis V, int *bin_node_number) {
+static rectangle_t *cross_axis(rectangle_t *P, ref_t R, int Cv, int Lv, axis V, int *bin_node_number) {
+	/*
+	** Depth-first search of the axis bin tree R for a rectangle intersecting P. Pending
+	** subtrees live on a fixed stack: every level adds at most one pending frame, so
+	** MAX_DEPTH frames per side are enough for any tree built by insert_axis.
+	*/
 	int F[]= {-1, 1};
+	axis_frame_t stack[2 * MAX_DEPTH];
+	axis_frame_t frame;
+	rectangle_t *rect;
+	bnode_t *T;
+	int top = 0;
 	direction D;
 
-	if (trace)
-		printf("%d%c ", *bin_node_number, V == 0 ? 'X' : 'Y');
+	stack[top].R = &R;
+	stack[top].Cv = Cv;
+	stack[top].Lv = Lv;
+	stack[top++].step = 0;
 
-	if (R == NULL)
-		return NULL;
-	else if ((R->rect != NULL) && (rect_intersect(P, R->rect->center[X], R->rect->center[Y], R->rect->lenght[X], R->rect->lenght[Y])))
-		return R->rect;
-	else {
-		D = bin_compare(P, Cv, V);
-		Lv = Lv / 2;
+	while (top > 0) {
+		frame = stack[--top];
+		*bin_node_number = *bin_node_number + frame.step;
+
+		if (trace)
+			fprintf(trace_out, "%d%c ", *bin_node_number, V == 0 ? 'X' : 'Y');
+
+		if (*frame.R == 0)
+			continue;
+		T = bnode_at(*frame.R);
+		nodes_visited++;
+		if ((T->rect != 0) && (rect = rect_at(T->rect), rect_intersect(P, rect->center[X], rect->center[Y], rect->lenght[X], rect->lenght[Y])))
+			return rect;
+
+		D = bin_compare(P, frame.Cv, V);
+		Lv = frame.Lv / 2;
 		*bin_node_number = *bin_node_number * 2;
 		if (D == BOTH) {
-			rectangle_t *intersected_rect;
-			*bin_node_number = *bin_node_number + 1;
-			intersected_rect = cross_axis(P, R->bson[LEFT], Cv - Lv, Lv, V, bin_node_number);
-			if (intersected_rect)
-				return intersected_rect;
-			*bin_node_number = *bin_node_number + 1;
-			intersected_rect = cross_axis(P, R->bson[LEFT], Cv + Lv, Lv, V, bin_node_number);
-			if (intersected_rect)
-				return intersected_rect;
-		}
-		else if (R->bson[D] == NULL)
-			return NULL;
-		else
-			return cross_axis(P, R->bson[D], Cv + F[D] * Lv, Lv, V, bin_node_number);
+			// Pushed in reverse so that the Cv - Lv half is visited first
+			stack[top].R = &T->bson[LEFT];
+			stack[top].Cv = frame.Cv + Lv;
+			stack[top].Lv = Lv;
+			stack[top++].step = 1;
+			stack[top].R = &T->bson[LEFT];
+			stack[top].Cv = frame.Cv - Lv;
+			stack[top].Lv = Lv;
+			stack[top++].step = 1;
+		}
+		else if (T->bson[D] != 0) {
+			stack[top].R = &T->bson[D];
+			stack[top].Cv = frame.Cv + F[D] * Lv;
+			stack[top].Lv = Lv;
+			stack[top++].step = 0;
+		}
 	}
 	return NULL;
 }
 
-static int rect_intersect(rectangle_t *P, int Cx, int Cy, int Lx, int Ly) {
+static inline int rect_intersect(rectangle_t *P, int Cx, int Cy, int Lx, int Ly) {
 	int intersect_x = 0, intersect_y = 0;
 	if ((P->center[X] - P->lenght[X] >= Cx - Lx) && (P->center[X] - P->lenght[X] <= Cx + Lx - 1))
 		intersect_x = 1;
@@ -211,251 +853,693 @@ static int rect_intersect(rectangle_t *P, int Cx, int Cy, int Lx, int Ly) {
 		return 0;
 }
 
-static rectangle_t *cif_search(rectangle_t *P, cnode_t *R, int Cx, int Cy, int Lx, int Ly, int *quad_node_number) {
+static rectangle_t *cif_search(rectangle_t *P, ref_t R, int Cx, int Cy, int Lx, int Ly, int *quad_node_number) {
 	int Sx[] = {-1, 1, -1, 1};
 	int Sy[] = {1, 1, -1, -1};
 	rectangle_t *intersected_rect;
-	int x_counter = 0, y_counter = 0;
+	cnode_t *T;
+	descent_t descent;
+	int x_counter, y_counter, depth = 0;
 	quadrant Q;
 
-	if (trace)
-		printf("%d ", *quad_node_number);
+	descent_open(&descent, P, Cx, Cy, Lx, Ly);
+	while (1) {
+		if (trace)
+			fprintf(trace_out, "%d ", *quad_node_number);
 
-	if (R == NULL)
-		return NULL;
-	else if (!rect_intersect(P, Cx, Cy, Lx, Ly)) // the rectangle must at least intersect the MX-CIF node quadrant (but since we're using cif_compare(...), this shouldn't be neccessary)
-		return NULL;
-	else {
-		intersected_rect = cross_axis(P, R->bson[X], Cx, Lx, X, &x_counter);
+		if (R == 0)
+			return NULL;
+		else if (!rect_intersect(P, Cx, Cy, Lx, Ly)) // the rectangle must at least intersect the MX-CIF node quadrant (but since we're using cif_compare(...), this shouldn't be neccessary)
+			return NULL;
+
+		T = cnode_at(R);
+		nodes_visited++;
+		x_counter = y_counter = 0;
+		intersected_rect = cross_axis(P, T->bson[X], Cx, Lx, X, &x_counter);
 		if (intersected_rect == NULL)
-			intersected_rect = cross_axis(P, R->bson[Y], Cy, Ly, Y, &y_counter);
+			intersected_rect = cross_axis(P, T->bson[Y], Cy, Ly, Y, &y_counter);
 		if (intersected_rect)
 			return intersected_rect;
-	}
 
-	Lx = Lx / 2;
-	Ly = Ly / 2;
-
-	Q = cif_compare(P, Cx, Cy);
-	*quad_node_number = *quad_node_number * 4 + Q + 1;
-	if (R->qson[Q])
-		intersected_rect = cif_search(P, R->qson[Q], Cx + Sx[Q] * Lx, Cy + Sy[Q] * Ly, Lx, Ly, quad_node_number);
-	if (intersected_rect != NULL)
-		return intersected_rect;
+		Lx = Lx / 2;
+		Ly = Ly / 2;
 
-	return NULL;
+		Q = (descent.levels > 0) ? descent_quadrant(&descent, depth++) : cif_compare(P, Cx, Cy);
+		*quad_node_number = *quad_node_number * 4 + Q + 1;
+		if (T->qson[Q] == 0)
+			return NULL;
+		R = T->qson[Q];
+		Cx = Cx + Sx[Q] * Lx;
+		Cy = Cy + Sy[Q] * Ly;
+	}
 }
 
-static rectangle_t *delete_from_axis(rectangle_t *P, bnode_t **R, int Cv, int Lv, axis V, int *bin_node_number) {
+static rectangle_t *find_in_axis(rectangle_t *P, ref_t R, int Cv, int Lv, axis V, int *bin_node_number, axis_step_t path[], int *found_depth, int exact) {
+	/*
+	** Same search as cross_axis, for the node delete_from_axis unlinks. As in the recursive
+	** formulation, every ancestor on the path where the search split (bin_compare returned
+	** BOTH) is removed as well. path[] records the son taken and the split state of each
+	** level of the current path, and the level of the matching node goes to found_depth.
+	** Nothing is written, so a search that fails leaves every version alone.
+	** With exact set only P itself matches, and the search follows the path insert_axis
+	** took for P without splitting, so that no other node is removed.
+	*/
 	int F[]= {-1, 1};
+	axis_frame_t stack[2 * MAX_DEPTH];
+	axis_frame_t frame;
+	rectangle_t *rect;
+	bnode_t *T;
+	int top = 0;
 	direction D;
 
-	if (trace)
-		printf("%d%c ", *bin_node_number, V == 0 ? 'X' : 'Y');
+	stack[top].R = &R;
+	stack[top].Cv = Cv;
+	stack[top].Lv = Lv;
+	stack[top].step = 0;
+	stack[top].depth = 0;
+	stack[top++].dir = LEFT;
 
-	if (*(R) == NULL)
-		return NULL;
-	else if (((*R)->rect != NULL) && (rect_intersect(P, (*R)->rect->center[X], (*R)->rect->center[Y], (*R)->rect->lenght[X], (*R)->rect->lenght[Y]))) {
-		rectangle_t	*return_rect = (*R)->rect;
-		delete_from_btree(R);
-		return return_rect;
-	}
-	else {
-		D = bin_compare(P, Cv, V);
-		Lv = Lv / 2;
-		if (Lv == 1)
-			return NULL;
+	while (top > 0) {
+		frame = stack[--top];
+		*bin_node_number = *bin_node_number + frame.step;
+
+		if (trace)
+			fprintf(trace_out, "%d%c ", *bin_node_number, V == 0 ? 'X' : 'Y');
+
+		path[frame.depth].dir = frame.dir;
+		path[frame.depth].split = 0;
+		if (*frame.R == 0)
+			continue;
+		T = bnode_at(*frame.R);
+		nodes_visited++;
+		if ((T->rect != 0) && (rect = rect_at(T->rect), exact ? (rect == P) : rect_intersect(P, rect->center[X], rect->center[Y], rect->lenght[X], rect->lenght[Y]))) {
+			*found_depth = frame.depth;
+			return rect;
+		}
+
+		D = bin_compare(P, frame.Cv, V);
+		Lv = frame.Lv / 2;
+		// P would be stored where its path meets the line
+		if (exact ? (D == BOTH) : (Lv == 1))
+			continue;
 		*bin_node_number = *bin_node_number * 2;
 		if (D == BOTH) {
-			rectangle_t *intersected_rect;
-			*bin_node_number = *bin_node_number + 1;
-			intersected_rect = delete_from_axis(P, &((*R)->bson[LEFT]), Cv - Lv, Lv, V, bin_node_number);
-			if (intersected_rect) {
-				delete_from_btree(R);
-				return intersected_rect;
-			}
-			*bin_node_number = *bin_node_number + 1;
-			intersected_rect = delete_from_axis(P, &((*R)->bson[LEFT]), Cv + Lv, Lv, V, bin_node_number);
-			if (intersected_rect) {
-				delete_from_btree(R);
-				return intersected_rect;
-			}
+			path[frame.depth].split = 1;
+			stack[top].R = &T->bson[LEFT];
+			stack[top].Cv = frame.Cv + Lv;
+			stack[top].Lv = Lv;
+			stack[top].step = 1;
+			stack[top].depth = frame.depth + 1;
+			stack[top++].dir = LEFT;
+			stack[top].R = &T->bson[LEFT];
+			stack[top].Cv = frame.Cv - Lv;
+			stack[top].Lv = Lv;
+			stack[top].step = 1;
+			stack[top].depth = frame.depth + 1;
+			stack[top++].dir = LEFT;
+		}
+		else if (T->bson[D] != 0) {
+			stack[top].R = &T->bson[D];
+			stack[top].Cv = frame.Cv + F[D] * Lv;
+			stack[top].Lv = Lv;
+			stack[top].step = 0;
+			stack[top].depth = frame.depth + 1;
+			stack[top++].dir = D;
 		}
-		else if ((*R)->bson[D] == NULL)
-			return NULL;
-		else
-			return delete_from_axis(P, &((*R)->bson[D]), Cv + F[D] * Lv, Lv, V, bin_node_number);
 	}
 	return NULL;
 }
 
-static rectangle_t *cif_delete(rectangle_t *P, cnode_t *R, int Cx, int Cy, int Lx, int Ly, int *quad_node_number) {
+static void delete_from_axis(ref_t *link, axis_step_t path[], int depth) {
+	/*
+	** Unlinks the node found by find_in_axis depth levels below *link, and the ancestors
+	** where the search split, innermost first. Only the nodes on path are copied.
+	*/
+	ref_t *links[MAX_DEPTH + 1];
+	int k;
+
+	links[0] = link;
+	cow_bnode(link);
+	for (k = 1; k <= depth; k++) {
+		links[k] = &bnode_at(*links[k - 1])->bson[path[k].dir];
+		cow_bnode(links[k]);
+	}
+
+	delete_from_btree(links[depth]);
+	for (k = depth - 1; k >= 0; k--) {
+		if (path[k].split)
+			delete_from_btree(links[k]);
+		if (*links[k] != 0)
+			summarize_bnode(*links[k]);
+	}
+}
+
+static rectangle_t *cif_delete(rectangle_t *P, ref_t *link, int Cx, int Cy, int Lx, int Ly, int *quad_node_number, int exact) {
+	/*
+	** Searches first and copies the path of quadtree and axis nodes to the rectangle
+	** found, if any, before unlinking it. With exact set only P itself is deleted, see
+	** find_in_axis.
+	*/
 	int Sx[] = {-1, 1, -1, 1};
 	int Sy[] = {1, 1, -1, -1};
 	rectangle_t *intersected_rect;
-	int Cv, Lv, v_counter = 0;
-	quadrant Q;
+	ref_t R = *link;
+	ref_t path[MAX_DEPTH + 1];
+	quadrant turn[MAX_DEPTH + 1];
+	axis_step_t axis_path[MAX_DEPTH + 1];
+	descent_t descent;
+	int v_counter, depth = 0, level = 0, found_depth = 0, k;
 	axis V;
+	quadrant Q;
 
-	if (trace)
-		printf("%d ", *quad_node_number);
+	descent_open(&descent, P, Cx, Cy, Lx, Ly);
+	while (1) {
+		if (trace)
+			fprintf(trace_out, "%d ", *quad_node_number);
 
-	if (R == NULL)
-		return NULL;
-	else if (!rect_intersect(P, Cx, Cy, Lx, Ly)) // the rectangle must at least intersect the MX-CIF node quadrant (but since we're using cif_compare(...), this shouldn't be neccessary)
-		return NULL;
-	else {
-		V = X;
-		Cv = Cx;
-		Lv = Lx;
+		if (R == 0)
+			return NULL;
+		else if (!rect_intersect(P, Cx, Cy, Lx, Ly)) // the rectangle must at least intersect the MX-CIF node quadrant (but since we're using cif_compare(...), this shouldn't be neccessary)
+			return NULL;
+
+		nodes_visited++;
 		v_counter = 0;
-		intersected_rect = delete_from_axis(P, &(R->bson[V]), Cv, Lv, V, &v_counter);
+		V = X;
+		intersected_rect = find_in_axis(P, cnode_at(R)->bson[X], Cx, Lx, X, &v_counter, axis_path, &found_depth, exact);
 		if (intersected_rect == NULL) {
-			V = Y;
-			Cv = Cy;
-			Lv = Ly;
 			v_counter = 0;
-			intersected_rect = delete_from_axis(P, &(R->bson[V]), Cv, Lv, V, &v_counter);
+			V = Y;
+			intersected_rect = find_in_axis(P, cnode_at(R)->bson[Y], Cy, Ly, Y, &v_counter, axis_path, &found_depth, exact);
 		}
 		if (intersected_rect)
-			return intersected_rect;
+			break;
+
+		Lx = Lx / 2;
+		Ly = Ly / 2;
+
+		Q = (descent.levels > 0) ? descent_quadrant(&descent, level++) : cif_compare(P, Cx, Cy);
+		*quad_node_number = *quad_node_number * 4 + Q + 1;
+		if (cnode_at(R)->qson[Q] == 0)
+			return NULL;
+		assert(depth < MAX_DEPTH);
+		turn[depth++] = Q;
+		R = cnode_at(R)->qson[Q];
+		Cx = Cx + Sx[Q] * Lx;
+		Cy = Cy + Sy[Q] * Ly;
+	}
+
+	for (k = 0; k <= depth; k++) {
+		if (k > 0)
+			link = &cnode_at(path[k - 1])->qson[turn[k - 1]];
+		path[k] = cow_cnode(link);
+	}
+	delete_from_axis(&cnode_at(path[depth])->bson[V], axis_path, found_depth);
+
+	++mutation_stamp;
+	stamp_cnode(path[depth], 1);
+	summarize_cnode(path[depth]);
+	while (depth > 0) {
+		R = path[--depth];
+		stamp_cnode(R, 0);
+		summarize_cnode(R);
 	}
+	return intersected_rect;
+}
 
-	Lx = Lx / 2;
-	Ly = Ly / 2;
+static void delete_from_btree(ref_t *node) {
+	/*
+	** A node with two sons trades its rectangle with its in-order predecessor, which has
+	** no right son and is unlinked in its place
+	*/
+	ref_t old_bnode, temp, *pred;
+	ref_t path[MAX_DEPTH + 1];
+	bnode_t *B = bnode_at(*node);
+	int depth = 0;
+
+	if ((B->bson[LEFT] != 0) && (B->bson[RIGHT] != 0)) {
+		pred = &B->bson[LEFT];
+		path[depth++] = *node;
+		cow_bnode(pred);
+		while (bnode_at(*pred)->bson[RIGHT] != 0) {
+			assert(depth < MAX_DEPTH);
+			path[depth++] = *pred;
+			pred = &bnode_at(*pred)->bson[RIGHT];
+			cow_bnode(pred);
+		}
+		temp = bnode_at(*pred)->rect;
+		bnode_at(*pred)->rect = B->rect;
+		B->rect = temp;
+		node = pred;
+	}
 
-	Q = cif_compare(P, Cx, Cy);
-	*quad_node_number = *quad_node_number * 4 + Q + 1;
-	if (R->qson[Q])
-		return cif_delete(P, R->qson[Q], Cx + Sx[Q] * Lx, Cy + Sy[Q] * Ly, Lx, Ly, quad_node_number);
+	old_bnode = *node;
+	B = bnode_at(old_bnode);
+	if (B->bson[LEFT] == 0)
+		*node = B->bson[RIGHT];
+	else
+		*node = B->bson[LEFT];
+	pool_free(&bnode_pool, old_bnode); // private to this version, and its remaining son was relinked above
 
-	return NULL;
+	// Only the nodes between the deleted one and its predecessor changed below *node
+	while (depth > 0)
+		summarize_bnode(path[--depth]);
 }
 
-static void delete_from_btree(bnode_t **node) {
-	bnode_t *old_bnode = *node;
-	if ((*node)->bson[LEFT] == NULL) {
-		*node = (*node)->bson[RIGHT];
-		free(old_bnode);
-	} else if ((*node)->bson[RIGHT] == NULL) {
-		*node = (*node)->bson[LEFT];
-		free(old_bnode);
-	} else {
-		bnode_t *pred = (*node)->bson[LEFT];
-		while (pred->bson[RIGHT] != NULL)
-			pred = pred->bson[RIGHT];
-		void *temp = pred->rect;
-		pred->rect = (*node)->rect;
-		(*node)->rect = temp;
+static void init_query_cache(void) {
+	int i;
 
-		delete_from_btree(&pred);
-	}
+	query_cache.count = query_cache.allocated = 0;
+	query_cache.free_list = -1;
+	query_cache.lru_head = query_cache.lru_tail = -1;
+	for (i = 0; i < QUERY_CACHE_BUCKETS; i++)
+		query_cache.bucket[i] = -1;
 }
 
-static void search_point(char args[][MAX_NAME_LEN + 1]) {
-	int px = atoi(args[0]), py = atoi(args[1]);
-	rectangle_t w;
-	rectangle_t *point_rect = (rectangle_t *)malloc(sizeof(rectangle_t));
+static inline int cache_bucket(query_kind kind, int lo[], int hi[]) {
+	unsigned int h = kind;
+
+	h = h * 31 + lo[X];
+	h = h * 31 + lo[Y];
+	h = h * 31 + hi[X];
+	h = h * 31 + hi[Y];
+	return (h ^ (h >> 11)) & (QUERY_CACHE_BUCKETS - 1);
+}
+
+static void cache_unlink(int i) {
+	cache_entry_t *e = &query_cache.entry[i];
+	int *link = &query_cache.bucket[cache_bucket(e->kind, e->lo, e->hi)];
+
+	while (*link != i)
+		link = &query_cache.entry[*link].hash_next;
+	*link = e->hash_next;
+
+	if (e->lru_prev >= 0)
+		query_cache.entry[e->lru_prev].lru_next = e->lru_next;
+	else
+		query_cache.lru_head = e->lru_next;
+	if (e->lru_next >= 0)
+		query_cache.entry[e->lru_next].lru_prev = e->lru_prev;
+	else
+		query_cache.lru_tail = e->lru_prev;
+}
+
+static void cache_link(int i) {
+	cache_entry_t *e = &query_cache.entry[i];
+	int b = cache_bucket(e->kind, e->lo, e->hi);
+
+	e->hash_next = query_cache.bucket[b];
+	query_cache.bucket[b] = i;
+
+	e->lru_prev = -1;
+	e->lru_next = query_cache.lru_head;
+	if (query_cache.lru_head >= 0)
+		query_cache.entry[query_cache.lru_head].lru_prev = i;
+	else
+		query_cache.lru_tail = i;
+	query_cache.lru_head = i;
+}
+
+static int cache_entry_valid(cache_entry_t *e, ref_t R, int Cx, int Cy, int Lx, int Ly) {
+	/*
+	** Rectangles that can affect a query live either in the subtree of the deepest node
+	** whose quadrant holds the whole query region (the anchor), or in the axis trees of
+	** the anchor's ancestors, which the region shares with its siblings. The entry is
+	** stale only if one of those changed after it was computed.
+	*/
+	int Sx[] = {-1, 1, -1, 1};
+	int Sy[] = {1, 1, -1, -1};
+	quadrant Q;
+
+	if (R == 0)
+		return 1;
+
+	while (1) {
+		if (cnode_stamps(R)->own_version > e->stamp)
+			return 0;
+		// Stop at the first subdivision line crossed by the region
+		if (((e->lo[X] <= Cx) && (Cx < e->hi[X])) || ((e->lo[Y] <= Cy) && (Cy < e->hi[Y])))
+			break;
+		Q = (e->lo[X] < Cx) ? ((e->lo[Y] < Cy) ? SW : NW) : ((e->lo[Y] < Cy) ? SE : NE);
+		if (cnode_at(R)->qson[Q] == 0)
+			break;
+		R = cnode_at(R)->qson[Q];
+		Lx = Lx / 2;
+		Ly = Ly / 2;
+		Cx = Cx + Sx[Q] * Lx;
+		Cy = Cy + Sy[Q] * Ly;
+	}
+
+	return cnode_stamps(R)->version <= e->stamp;
+}
+
+static cache_entry_t *cache_lookup(query_kind kind, int lo[], int hi[]) {
+	/*
+	** Returns the cached result of the query, or NULL after counting a miss. Stale entries
+	** found on the way are dropped.
+	*/
+	rectangle_t w = mx_cif_tree->world;
+	cache_entry_t *e;
+	int i;
+
+	for (i = query_cache.bucket[cache_bucket(kind, lo, hi)]; i >= 0; i = e->hash_next) {
+		e = &query_cache.entry[i];
+		if ((e->kind != kind) || (e->lo[X] != lo[X]) || (e->lo[Y] != lo[Y]) || (e->hi[X] != hi[X]) || (e->hi[Y] != hi[Y]))
+			continue;
+
+		cache_unlink(i);
+		if (cache_entry_valid(e, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y])) {
+			cache_link(i);
+			query_cache.hits++;
+			return e;
+		}
+
+		query_cache.invalidated++;
+		query_cache.count--;
+		e->hash_next = query_cache.free_list;
+		query_cache.free_list = i;
+		break;
+	}
+
+	query_cache.misses++;
+	return NULL;
+}
+
+static cache_entry_t *cache_store(query_kind kind, int lo[], int hi[]) {
+	/*
+	** Returns a fresh entry for the query, evicting the least recently used one if the
+	** cache is full. The caller fills in the result.
+	*/
+	cache_entry_t *e;
+	int i;
+
+	if (query_cache.free_list >= 0) {
+		i = query_cache.free_list;
+		query_cache.free_list = query_cache.entry[i].hash_next;
+		query_cache.count++;
+	} else if (query_cache.allocated < QUERY_CACHE_SIZE) {
+		i = query_cache.allocated++;
+		query_cache.count++;
+	} else {
+		i = query_cache.lru_tail;
+		cache_unlink(i);
+	}
+
+	e = &query_cache.entry[i];
+	e->kind = kind;
+	e->lo[X] = lo[X];
+	e->lo[Y] = lo[Y];
+	e->hi[X] = hi[X];
+	e->hi[Y] = hi[Y];
+	e->stamp = mutation_stamp;
+	cache_link(i);
+	return e;
+}
+
+static inline int cache_usable(void) {
+	// Traced queries must walk the tree to print the visited nodes
+	return query_cache.enabled && !trace;
+}
+
+static rectangle_t *cached_search(query_kind kind, rectangle_t *P) {
+	/*
+	** cif_search over the whole quadtree, through the query cache when it is enabled
+	*/
+	rectangle_t w = mx_cif_tree->world;
+	cache_entry_t *e;
+	int lo[NDIR_1D], hi[NDIR_1D];
+	int counter = 0;
+
+	// The writer looks queries run in parallel up before the run and stores them after it
+	if (queries_in_parallel) {
+		if (!query_cached[current_query])
+			query_result[current_query] = cif_search(P, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter);
+		return query_result[current_query];
+	}
+
+	if (!cache_usable())
+		return cif_search(P, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter);
+
+	lo[X] = P->center[X] - P->lenght[X];
+	lo[Y] = P->center[Y] - P->lenght[Y];
+	hi[X] = P->center[X] + P->lenght[X];
+	hi[Y] = P->center[Y] + P->lenght[Y];
+	if ((e = cache_lookup(kind, lo, hi)) != NULL)
+		return e->rect;
+
+	e = cache_store(kind, lo, hi);
+	e->rect = cif_search(P, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter);
+	return e->rect;
+}
+
+static void cache_command(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	/*
+	** CACHE(ON) enables the query cache with empty statistics, CACHE(OFF) disables it
+	*/
+	if (strcmp(args[0], "ON") == 0) {
+		init_query_cache();
+		query_cache.hits = query_cache.misses = query_cache.invalidated = 0;
+		query_cache.enabled = 1;
+		column_keep(&cnode_pool, STAMPS_COLUMN, sizeof(stamps_t));
+		fprintf(out, "QUERY CACHE ENABLED WITH %d ENTRIES\n", QUERY_CACHE_SIZE);
+	} else {
+		query_cache.enabled = 0;
+		column_drop(&cnode_pool, STAMPS_COLUMN);
+		fprintf(out, "QUERY CACHE DISABLED\n");
+	}
+}
+
+static void cache_stats(FILE *out) {
+	fprintf(out, "QUERY CACHE: %lu HITS, %lu MISSES, %lu INVALIDATED, %d ENTRIES\n",
+		query_cache.hits, query_cache.misses, query_cache.invalidated, query_cache.count);
+}
+
+static void search_point(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	int px = atoi(args[0]), py = atoi(args[1]);
+	rectangle_t point, *point_rect = &point;
 	point_rect->center[X] = px;
 	point_rect->center[Y] = py;
-	int counter = 0;
+	point_rect->lenght[X] = point_rect->lenght[Y] = 0;
 
-	w = mx_cif_tree->world;
-	rectangle_t *intersected_rect = cif_search(point_rect, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter);
+	rectangle_t *intersected_rect = cached_search(POINT_QUERY, point_rect);
 	if (intersected_rect != NULL) {
 		if (trace)
-			printf("\n");
-		printf("POINT (%d,%d) CONTAINED BY RECTANGLE %s(%d,%d,%d,%d)\n", point_rect->center[X], point_rect->center[Y],
+			fprintf(out, "\n");
+		fprintf(out, "POINT (%d,%d) CONTAINED BY RECTANGLE %s(%d,%d,%d,%d)\n", point_rect->center[X], point_rect->center[Y],
 			intersected_rect->rect_name, intersected_rect->center[X], intersected_rect->center[Y], intersected_rect->lenght[X], intersected_rect->lenght[Y]);
 	}
 	else {
 		if (trace)
-			printf("\n");
-		printf("POINT (%d,%d) NOT CONTAINED BY ANY RECTANGLE\n", point_rect->center[X], point_rect->center[Y]);
+			fprintf(out, "\n");
+		fprintf(out, "POINT (%d,%d) NOT CONTAINED BY ANY RECTANGLE\n", point_rect->center[X], point_rect->center[Y]);
 	}
 }
 
-static void insert_rectangle(char args[][MAX_NAME_LEN + 1]) {
-	char *name = args[0];
-	rectangle_t *rectangle;
-	bnode_t *node;
+static rectangle_t *find_rectangle(char *name) {
+	ref_t rect = find_btree(rect_tree, name);
+
+	return (rect != 0) ? rect_at(rect) : NULL;
+}
+
+static int fits_world(rectangle_t *P) {
+	rectangle_t w = mx_cif_tree->world;
 
-	rectangle = (rectangle_t *)malloc(sizeof(rectangle_t));
-	rectangle->rect_name = name;
+	return ((P->center[X] + P->lenght[X]) <= w.center[X] + w.lenght[X]) && ((P->center[Y] + P->lenght[Y]) <= w.center[Y] + w.lenght[Y]);
+}
 
-	node = (bnode_t *)malloc(sizeof(bnode_t));
-	node->rect = rectangle;
+static void print_insert_failed(FILE *out, rectangle_t *P) {
+	fprintf(out, "INSERTION OF RECTANGLE %s(%d,%d,%d,%d) FAILED AS %s LIES PARTIALLY OUTSIDE SPACE SPANNED BY MX-CIF QUADTREE\n", P->rect_name, P->center[X], P->center[Y], P->lenght[X], P->lenght[Y], P->rect_name);
+}
 
-	node = find_btree(rect_tree, node);
+static void print_inserted(FILE *out, rectangle_t *P) {
+	fprintf(out, "RECTANGLE %s(%d,%d,%d,%d) INSERTED\n", P->rect_name, P->center[X], P->center[Y], P->lenght[X], P->lenght[Y]);
+}
 
+static void insert_rectangle(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	ref_t rect = find_btree(rect_tree, args[0]);
+	rectangle_t *P;
 	rectangle_t w = mx_cif_tree->world;
-	if (((node->rect->center[X] + node->rect->lenght[X]) > w.center[X] + w.lenght[X]) || ((node->rect->center[Y] + node->rect->lenght[Y]) > w.center[Y] + w.lenght[Y]))
-		printf("INSERTION OF RECTANGLE %s(%d,%d,%d,%d) FAILED AS %s LIES PARTIALLY OUTSIDE SPACE SPANNED BY MX-CIF QUADTREE\n", node->rect->rect_name, node->rect->center[X], node->rect->center[Y], node->rect->lenght[X], node->rect->lenght[Y], node->rect->rect_name);
+
+	if (rect == 0) {
+		fprintf(out, "RECTANGLE %s DOES NOT EXIST\n", args[0]);
+		return;
+	}
+	P = rect_at(rect);
+	if (!fits_world(P))
+		print_insert_failed(out, P);
 	else {
-		cif_insert(node->rect, mx_cif_tree, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y]);
+		cif_insert(rect, mx_cif_tree, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y]);
 		if (trace)
-			printf("\n");
-		printf("RECTANGLE %s(%d,%d,%d,%d) INSERTED\n", node->rect->rect_name, node->rect->center[X], node->rect->center[Y], node->rect->lenght[X], node->rect->lenght[Y]);
+			fprintf(out, "\n");
+		print_inserted(out, P);
 	}
 }
 
-static void list_rectangles(void) {
-	print_in_order(rect_tree);
-	printf("\n");
+static FILE *reply_open(command_t *command) {
+	/*
+	** Returns the stream the reply of command is printed to: standard output, or a buffer
+	** handed to its completion slot by reply_close if it has one
+	*/
+	if (command->completion == NULL)
+		return stdout;
+	return open_memstream(&command->completion->reply, &command->completion->len);
 }
 
-static bnode_t *find_btree(bnode_t *tree, bnode_t *node) {
-	if (!tree)
-		return NULL;
+static void reply_close(FILE *out) {
+	if (out != stdout)
+		fclose(out);
+}
 
-	if (strcmp(tree->rect->rect_name, node->rect->rect_name) == 0)
-		return node = tree;
-	else if (strcmp(tree->rect->rect_name, node->rect->rect_name) > 0)
-		node = find_btree(tree->bson[LEFT], node);
-	else
-		node = find_btree(tree->bson[RIGHT], node);
+static void insert_path_key(rectangle_t *P, unsigned long long *key, int *depth) {
+	/*
+	** Encodes the quadrant path cif_insert will follow for P, two bits per level from the
+	** most significant end, so that sorting by (key, depth) orders destinations the way a
+	** pre-order traversal visits them
+	*/
+	int Sx[] = {-1, 1, -1, 1};
+	int Sy[] = {1, 1, -1, -1};
+	rectangle_t w = mx_cif_tree->world;
+	int Cx = w.center[X], Cy = w.center[Y], Lx = w.lenght[X], Ly = w.lenght[Y];
+	descent_t descent;
+	quadrant Q;
 
-	return node;
+	*key = 0;
+	*depth = 0;
+	descent_open(&descent, P, Cx, Cy, Lx, Ly);
+	if ((descent.levels > 0) && ((*depth = descent_stop(&descent, P)) >= 0)) {
+		if (*depth > 0)
+			*key = (descent.key >> (2 * (descent.levels - *depth))) << (2 * (MAX_DEPTH - *depth));
+		return;
+	}
+	*depth = 0;
+	while ((*depth < MAX_DEPTH) && (bin_compare(P, Cx, X) != BOTH) && (bin_compare(P, Cy, Y) != BOTH)) {
+		Q = cif_compare(P, Cx, Cy);
+		*key |= (unsigned long long)Q << (2 * (MAX_DEPTH - 1 - *depth));
+		(*depth)++;
+		Lx = Lx / 2;
+		Ly = Ly / 2;
+		Cx = Cx + Sx[Q] * Lx;
+		Cy = Cy + Sy[Q] * Ly;
+	}
 }
 
-static void insert_to_btree(bnode_t **root, bnode_t *newNode) {
-	if (*root == NULL) {
-		*root = newNode;
+static void insert_run(command_t *run, int n) {
+	/*
+	** Applies a run of consecutive INSERT commands in quadrant path order, so that inserts
+	** landing in the same region of the tree are applied together. Inserts with different
+	** destination nodes commute and equal destinations keep their order (the sort is
+	** stable), so the tree ends up as if the run had been applied in order. The replies
+	** are printed afterwards in the original order.
+	*/
+	ref_t rect[INGEST_BATCH_SIZE];
+	unsigned long long key[INGEST_BATCH_SIZE];
+	int depth[INGEST_BATCH_SIZE], order[INGEST_BATCH_SIZE];
+	rectangle_t w = mx_cif_tree->world;
+	FILE *out;
+	int i, j, o;
+
+	for (i = 0; i < n; i++)
+		if ((rect[i] = find_btree(rect_tree, run[i].args[0])) == 0)
+			break;
+	if ((n == 1) || (i < n)) {
+		for (i = 0; i < n; i++) {
+			out = reply_open(&run[i]);
+			insert_rectangle(out, run[i].args);
+			reply_close(out);
+		}
 		return;
 	}
 
-	if (strcmp((*root)->rect->rect_name, newNode->rect->rect_name) > 0)
-		insert_to_btree(&(*root)->bson[LEFT], newNode);
-	else if (strcmp((*root)->rect->rect_name, newNode->rect->rect_name ))
-		insert_to_btree(&(*root)->bson[RIGHT], newNode);
+	for (i = 0; i < n; i++) {
+		insert_path_key(rect_at(rect[i]), &key[i], &depth[i]);
+		o = i;
+		for (j = i; (j > 0) && ((key[order[j - 1]] > key[o]) || ((key[order[j - 1]] == key[o]) && (depth[order[j - 1]] > depth[o]))); j--)
+			order[j] = order[j - 1];
+		order[j] = o;
+	}
+
+	for (i = 0; i < n; i++)
+		if (fits_world(rect_at(rect[order[i]])))
+			cif_insert(rect[order[i]], mx_cif_tree, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y]);
+
+	for (i = 0; i < n; i++) {
+		out = reply_open(&run[i]);
+		if (fits_world(rect_at(rect[i])))
+			print_inserted(out, rect_at(rect[i]));
+		else
+			print_insert_failed(out, rect_at(rect[i]));
+		reply_close(out);
+	}
+}
+
+static void list_rectangles(FILE *out) {
+	walk_in_order(out, rect_tree, print_rectangle);
+	fprintf(out, "\n");
+}
+
+static ref_t find_btree(ref_t tree, char *name) {
+	int cmp;
+
+	while (tree != 0) {
+		cmp = strcmp(rect_at(tree)->rect_name, name);
+		if (cmp == 0)
+			return tree;
+		tree = rect_at(tree)->bson[cmp > 0 ? LEFT : RIGHT];
+	}
+
+	return 0;
+}
+
+static int insert_to_btree(ref_t *root, ref_t newNode) {
+	int cmp;
+
+	while (*root != 0) {
+		cmp = strcmp(rect_at(*root)->rect_name, rect_at(newNode)->rect_name);
+		if (cmp == 0)
+			return 0;
+		root = &rect_at(*root)->bson[cmp > 0 ? LEFT : RIGHT];
+	}
+
+	*root = newNode;
+	return 1;
 }
 
-static void create_rectangle(char args[][MAX_NAME_LEN + 1]) {
+static void add_rectangle(char args[][MAX_NAME_LEN + 1]) {
 	char *name = args[0];
 	int cx = atoi(args[1]);
 	int cy = atoi(args[2]);
 	int lx = atoi(args[3]);
 	int ly = atoi(args[4]);
 
-	rectangle_t *new_rectangle = (rectangle_t *)malloc(sizeof(rectangle_t));
-	new_rectangle->rect_name = strdup(name);
-	new_rectangle->bson[LEFT] = new_rectangle->bson[RIGHT] = NULL;
+	ref_t rect = pool_alloc(&rect_pool);
+	rectangle_t *new_rectangle = rect_at(rect);
+	new_rectangle->rect_name = name;
+	new_rectangle->bson[LEFT] = new_rectangle->bson[RIGHT] = 0;
 	new_rectangle->center[X] = cx;
 	new_rectangle->center[Y] = cy;
 	new_rectangle->lenght[X] = lx;
 	new_rectangle->lenght[Y] = ly;
+	new_rectangle->placed = 0;
 
-	bnode_t *new_node = (bnode_t *)malloc(sizeof(bnode_t));
-	new_node->rect = new_rectangle;
-	new_node->bson[LEFT] = new_node->bson[RIGHT] = NULL;
-	insert_to_btree(&rect_tree, new_node);
+	// A name that is taken leaves the existing rectangle in place
+	if (insert_to_btree(&rect_tree, rect))
+		new_rectangle->rect_name = pool_name(name);
+	else
+		pool_free(&rect_pool, rect);
+}
 
-	printf("CREATED RECTANGLE %s(%d,%d,%d,%d)\n", name, cx, cy, lx, ly);
+static void create_rectangle(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	add_rectangle(args);
+	fprintf(out, "CREATED RECTANGLE %s(%d,%d,%d,%d)\n", args[0], atoi(args[1]), atoi(args[2]), atoi(args[3]), atoi(args[4]));
 }
 
-static void init_quadtree(char args[][MAX_NAME_LEN + 1]) {
+static void init_quadtree(FILE *out, char args[][MAX_NAME_LEN + 1]) {
 	int width = atoi(args[0]);
 
+	if ((width < 1) || (width > MAX_WIDTH)) {
+		fprintf(out, "MX-CIF QUADTREE 0 NOT INITIALIZED: PARAMETER %d OUT OF RANGE [1,%d]\n", width, MAX_WIDTH);
+		return;
+	}
+
 	scale_factor = DISPLAY_SIZE / (1 << width);
 
 	mx_cif_tree->world.lenght[X] = (1 << width) / 2;
@@ -463,132 +1547,372 @@ static void init_quadtree(char args[][MAX_NAME_LEN + 1]) {
 	mx_cif_tree->world.center[X] = (1 << width) / 2;
 	mx_cif_tree->world.center[Y] = (1 << width) / 2;
 
-	printf("MX-CIF QUADTREE 0 INITIALIZED WITH PARAMETER %d\n", width);
+	init_query_cache();
+	fprintf(out, "MX-CIF QUADTREE 0 INITIALIZED WITH PARAMETER %d\n", width);
 }
 
-static void traverse_bintree(bnode_t *node) {
-	if (node != NULL) {
-		if (node->rect)
-			printf("%s\n", node->rect->rect_name);
-		traverse_bintree(node->bson[LEFT]);
-		traverse_bintree(node->bson[RIGHT]);
+static void traverse_bintree(FILE *out, ref_t node) {
+	ref_t stack[MAX_DEPTH + 1];
+	bnode_t *B;
+	int top = 0;
+
+	if (node != 0)
+		stack[top++] = node;
+
+	while (top > 0) {
+		B = bnode_at(stack[--top]);
+		if (B->rect)
+			fprintf(out, "%s\n", rect_at(B->rect)->rect_name);
+		if (B->bson[RIGHT] != 0)
+			stack[top++] = B->bson[RIGHT];
+		if (B->bson[LEFT] != 0)
+			stack[top++] = B->bson[LEFT];
 	}
 }
 
-static void traverse_quadtree(cnode_t *node) {
-	if (node != NULL) {
-		traverse_bintree(node->bson[X]);
-		traverse_bintree(node->bson[Y]);
+static void traverse_quadtree(FILE *out, ref_t node) {
+	/*
+	** Pre-order walk in NW, NE, SW, SE order. Each level leaves at most three siblings
+	** pending on the stack.
+	*/
+	ref_t stack[3 * MAX_DEPTH + 1];
+	cnode_t *C;
+	int top = 0, Q;
+
+	if (node != 0)
+		stack[top++] = node;
+
+	while (top > 0) {
+		C = cnode_at(stack[--top]);
+		traverse_bintree(out, C->bson[X]);
+		traverse_bintree(out, C->bson[Y]);
 
-		traverse_quadtree(node->qson[NW]);
-		traverse_quadtree(node->qson[NE]);
-		traverse_quadtree(node->qson[SW]);
-		traverse_quadtree(node->qson[SE]);
+		for (Q = SE; Q >= NW; Q--)
+			if (C->qson[Q] != 0)
+				stack[top++] = C->qson[Q];
 	}
 }
 
-static void display(void) {
-	StartPicture(DISPLAY_SIZE + 1, DISPLAY_SIZE + 1);
+static void display(FILE *out) {
+	StartPicture(out, DISPLAY_SIZE + 1, DISPLAY_SIZE + 1);
 	SetLineDash(3, 3);
 	DrawRect(0, DISPLAY_SIZE, DISPLAY_SIZE, 0);
 	SetLineDash(3, 3);
-	traverse_quadtree(mx_cif_tree->mx_cif_root);
+	traverse_quadtree(out, mx_cif_tree->mx_cif_root);
 	EndPicture();
 }
 
-static void rectangle_search(char args[][MAX_NAME_LEN + 1]) {
-	char *name = args[0];
-	rectangle_t *search_rect, w;
-	bnode_t *node;
-	int counter = 0;
+static inline int rect_in_window(rectangle_t *P, int lo[], int hi[]) {
+	return (P->center[X] - P->lenght[X] >= lo[X]) && (P->center[X] + P->lenght[X] <= hi[X]) &&
+		(P->center[Y] - P->lenght[Y] >= lo[Y]) && (P->center[Y] + P->lenght[Y] <= hi[Y]);
+}
+
+static inline int summary_misses_window(summary_t *sum, int lo[], int hi[]) {
+	return (sum->count == 0) || (sum->hi[X] <= lo[X]) || (sum->lo[X] >= hi[X]) || (sum->hi[Y] <= lo[Y]) || (sum->lo[Y] >= hi[Y]);
+}
+
+static void cursor_push(cursor_t *cur, int is_axis, ref_t node) {
+	if (node == 0)
+		return;
+	// Subtrees whose bounding box misses the window cannot hold a rectangle inside it
+	if (summary_misses_window(node_sum(is_axis, node), cur->lo, cur->hi))
+		return;
+
+	cur->stack[cur->top].is_axis = is_axis;
+	cur->stack[cur->top++].node = node;
+}
+
+static void cursor_close(cursor_t *cur) {
+	cur->open = 0;
+	cur->top = 0;
+	unpin_version(cur->root);
+	cur->root = 0;
+}
+
+static void cursor_open(cursor_t *cur, int llx, int lly, int lx, int ly) {
+	/*
+	** Prepares cur to report the rectangles of the current version lying entirely inside
+	** the window with lower left corner (llx,lly) and extent (lx,ly). Nothing is searched
+	** until cursor_next.
+	*/
+	cursor_close(cur);
+	cur->open = 1;
+	cur->lo[X] = llx;
+	cur->lo[Y] = lly;
+	cur->hi[X] = llx + lx;
+	cur->hi[Y] = lly + ly;
+	cur->top = 0;
+	// Pin the current version: writers copy the nodes they change from now on
+	keep_summaries();
+	cur->root = pin_version();
+	cursor_push(cur, 0, cur->root);
+}
+
+static rectangle_t *cursor_next(cursor_t *cur) {
+	/*
+	** Returns the next rectangle of the window in pre-order (axis trees of a quadtree node
+	** first, then its NW, NE, SW and SE sons), or NULL once the cursor is exhausted. All
+	** traversal state lives on the cursor's fixed stack and the cursor walks the version
+	** it pinned when opened, so it can be resumed at any point and is not affected by
+	** later mutations.
+	*/
+	walk_frame_t frame;
+	int Q;
+
+	while (cur->top > 0) {
+		frame = cur->stack[--cur->top];
+		nodes_visited++;
+
+		if (frame.is_axis) {
+			bnode_t *T = bnode_at(frame.node);
+
+			cursor_push(cur, 1, T->bson[RIGHT]);
+			cursor_push(cur, 1, T->bson[LEFT]);
+			if ((T->rect != 0) && rect_in_window(rect_at(T->rect), cur->lo, cur->hi))
+				return rect_at(T->rect);
+		} else {
+			cnode_t *T = cnode_at(frame.node);
+
+			for (Q = SE; Q >= NW; Q--)
+				cursor_push(cur, 0, T->qson[Q]);
+			cursor_push(cur, 1, T->bson[Y]);
+			cursor_push(cur, 1, T->bson[X]);
+		}
+	}
+
+	cursor_close(cur);
+	return NULL;
+}
+
+static void print_window_page(FILE *out, cursor_t *cur, int limit, int first_page) {
+	/*
+	** Prints up to limit rectangles from cur (all of them when limit <= 0)
+	*/
+	rectangle_t *rect;
+	int count = 0;
+
+	while (((limit <= 0) || (count < limit)) && ((rect = cursor_next(cur)) != NULL)) {
+		if (count == 0)
+			fprintf(out, "RECTANGLES IN WINDOW (%d,%d,%d,%d): ", cur->lo[X], cur->lo[Y], cur->hi[X] - cur->lo[X], cur->hi[Y] - cur->lo[Y]);
+		print_rectangle(out, rect);
+		count++;
+	}
+
+	if (count > 0)
+		fprintf(out, "\n");
+	else
+		fprintf(out, "NO %sRECTANGLES IN WINDOW (%d,%d,%d,%d)\n", first_page ? "" : "MORE ",
+			cur->lo[X], cur->lo[Y], cur->hi[X] - cur->lo[X], cur->hi[Y] - cur->lo[Y]);
+}
+
+static void window(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	/*
+	** WINDOW(llx,lly,lx,ly[,limit]): with a limit, only the first page is printed and the
+	** cursor stays open for FETCH, which pages through the tree as it was at this point
+	*/
+	int llx = atoi(args[0]);
+	int lly = atoi(args[1]);
+	int lx = atoi(args[2]);
+	int ly = atoi(args[3]);
+	int limit = atoi(args[4]);
+
+	cursor_open(&window_cursor, llx, lly, lx, ly);
+	print_window_page(out, &window_cursor, limit, 1);
+}
+
+static void fetch(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	int limit = atoi(args[0]);
+
+	if (!window_cursor.open)
+		fprintf(out, "NO OPEN WINDOW\n");
+	else
+		print_window_page(out, &window_cursor, limit, 0);
+}
+
+static void window_aggregate(ref_t root, int lo[], int hi[], summary_t *result) {
+	/*
+	** Adds to result the rectangles of the quadtree rooted at root that lie entirely inside
+	** the window [lo, hi). A subtree whose bounding box is inside the window contributes its
+	** aggregate as a whole and one whose box misses the window is skipped, so only subtrees
+	** straddling the window boundary are descended into.
+	*/
+	walk_frame_t stack[WALK_STACK_SIZE];
+	summary_t *sum;
+	int top = 0, V, Q;
+
+	result->count = 0;
+	result->area = 0;
+	if (root != 0) {
+		stack[top].is_axis = 0;
+		stack[top++].node = root;
+	}
+
+	while (top > 0) {
+		top--;
+		nodes_visited++;
+		sum = node_sum(stack[top].is_axis, stack[top].node);
+		if (summary_misses_window(sum, lo, hi))
+			continue;
+		if ((sum->lo[X] >= lo[X]) && (sum->hi[X] <= hi[X]) && (sum->lo[Y] >= lo[Y]) && (sum->hi[Y] <= hi[Y])) {
+			summary_merge(result, sum);
+			continue;
+		}
+
+		if (stack[top].is_axis) {
+			bnode_t *B = bnode_at(stack[top].node);
+
+			if ((B->rect != 0) && rect_in_window(rect_at(B->rect), lo, hi))
+				summary_add_rect(result, rect_at(B->rect));
+			for (V = LEFT; V <= RIGHT; V++)
+				if (B->bson[V] != 0) {
+					stack[top].is_axis = 1;
+					stack[top++].node = B->bson[V];
+				}
+		} else {
+			cnode_t *C = cnode_at(stack[top].node);
+
+			// Sons first, so that they are only left pending while the axis trees are walked
+			for (Q = NW; Q <= SE; Q++)
+				if (C->qson[Q] != 0) {
+					stack[top].is_axis = 0;
+					stack[top++].node = C->qson[Q];
+				}
+			for (V = Y; V >= X; V--)
+				if (C->bson[V] != 0) {
+					stack[top].is_axis = 1;
+					stack[top++].node = C->bson[V];
+				}
+		}
+	}
+}
+
+static void cached_window_aggregate(int lo[], int hi[], summary_t *result) {
+	cache_entry_t *e;
+
+	keep_summaries();
+	if (!cache_usable()) {
+		window_aggregate(mx_cif_tree->mx_cif_root, lo, hi, result);
+		return;
+	}
+
+	if ((e = cache_lookup(WINDOW_QUERY, lo, hi)) == NULL) {
+		e = cache_store(WINDOW_QUERY, lo, hi);
+		window_aggregate(mx_cif_tree->mx_cif_root, lo, hi, &e->sum);
+	}
+	*result = e->sum;
+}
+
+static void count_window(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	int lo[NDIR_1D], hi[NDIR_1D];
+	summary_t result;
+
+	lo[X] = atoi(args[0]);
+	lo[Y] = atoi(args[1]);
+	hi[X] = lo[X] + atoi(args[2]);
+	hi[Y] = lo[Y] + atoi(args[3]);
+
+	cached_window_aggregate(lo, hi, &result);
+	fprintf(out, "WINDOW (%d,%d,%d,%d) CONTAINS %d RECTANGLES\n", lo[X], lo[Y], hi[X] - lo[X], hi[Y] - lo[Y], result.count);
+}
 
-	// Find the rectangle in the DB (BST) by its name
-	search_rect = (rectangle_t *)malloc(sizeof(rectangle_t));
-	search_rect->rect_name = name;
-	node = (bnode_t *)malloc(sizeof(bnode_t));
-	node->rect = search_rect;
-	node = find_btree(rect_tree, node);
+static void area_window(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	int lo[NDIR_1D], hi[NDIR_1D];
+	summary_t result;
+
+	lo[X] = atoi(args[0]);
+	lo[Y] = atoi(args[1]);
+	hi[X] = lo[X] + atoi(args[2]);
+	hi[Y] = lo[Y] + atoi(args[3]);
+
+	cached_window_aggregate(lo, hi, &result);
+	fprintf(out, "RECTANGLES IN WINDOW (%d,%d,%d,%d) HAVE TOTAL AREA %ld\n", lo[X], lo[Y], hi[X] - lo[X], hi[Y] - lo[Y], result.area);
+}
+
+static void rectangle_search(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	rectangle_t *P = find_rectangle(args[0]), *over_rect;
+
+	if (P == NULL) {
+		fprintf(out, "RECTANGLE %s DOES NOT EXIST\n", args[0]);
+		return;
+	}
 
 	// Find an intersecting rectangle in the MX-CIF
-	w = mx_cif_tree->world;
-	rectangle_t *over_rect = cif_search(node->rect, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter);
+	over_rect = cached_search(RECTANGLE_QUERY, P);
 	if (trace)
-		printf("\n");
+		fprintf(out, "\n");
 	if (over_rect != NULL)
-		printf("RECTANGLE %s(%d,%d,%d,%d) OVERLAPS RECTANGLE %s(%d,%d,%d,%d)\n",
-			node->rect->rect_name, node->rect->center[X], node->rect->center[Y], node->rect->lenght[X], node->rect->lenght[Y],
+		fprintf(out, "RECTANGLE %s(%d,%d,%d,%d) OVERLAPS RECTANGLE %s(%d,%d,%d,%d)\n",
+			P->rect_name, P->center[X], P->center[Y], P->lenght[X], P->lenght[Y],
 			over_rect->rect_name, over_rect->center[X], over_rect->center[Y], over_rect->lenght[X], over_rect->lenght[Y]);
 	else
-		printf("RECTANGLE %s(%d,%d,%d,%d) DOES NOT OVERLAP ANY RECTANGLES\n",
-			node->rect->rect_name, node->rect->center[X], node->rect->center[Y], node->rect->lenght[X], node->rect->lenght[Y]);
+		fprintf(out, "RECTANGLE %s(%d,%d,%d,%d) DOES NOT OVERLAP ANY RECTANGLES\n",
+			P->rect_name, P->center[X], P->center[Y], P->lenght[X], P->lenght[Y]);
 }
 
-static void delete_rectangle(char args[][MAX_NAME_LEN + 1]) {
-	char *name = args[0];
-	rectangle_t *search_rect, w;
-	bnode_t *node;
+static void delete_rectangle(FILE *out, char args[][MAX_NAME_LEN + 1], int exact) {
+	/*
+	** DELETE_RECTANGLE(name) deletes the first rectangle found intersecting the named one.
+	** DELETE_RECTANGLE(name,EXACT), which the router of a sharded quadtree sends, deletes
+	** the named rectangle only, so that every worker holding a copy deletes the same one.
+	*/
+	rectangle_t *P = find_rectangle(args[0]), w;
 	int counter = 0;
 
-	// Find the rectangle in the DB (BST) by its name
-	search_rect = (rectangle_t *)malloc(sizeof(rectangle_t));
-	search_rect->rect_name = name;
-	node = (bnode_t *)malloc(sizeof(bnode_t));
-	node->rect = search_rect;
-	node = find_btree(rect_tree, node);
-
+	if (P == NULL) {
+		fprintf(out, "RECTANGLE %s DOES NOT EXIST\n", args[0]);
+		return;
+	}
 	w = mx_cif_tree->world;
-	rectangle_t *deleted_rect = cif_delete(node->rect, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter);
+	rectangle_t *deleted_rect = cif_delete(P, &mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter, exact);
 	if (trace)
-		printf("\n");
+		fprintf(out, "\n");
 	if (deleted_rect != NULL){
-		printf("RECTANGLE %s(%d,%d,%d,%d) DELETED\n",
+		fprintf(out, "RECTANGLE %s(%d,%d,%d,%d) DELETED\n",
 			deleted_rect->rect_name, deleted_rect->center[X], deleted_rect->center[Y], deleted_rect->lenght[X], deleted_rect->lenght[Y]);
 		}
 	else
-		printf("RECTANGLE %s(%d,%d,%d,%d) DOES NOT EXIST IN THE QUADTREE\n",
-			node->rect->rect_name, node->rect->center[X], node->rect->center[Y], node->rect->lenght[X], node->rect->lenght[Y]);
+		fprintf(out, "RECTANGLE %s(%d,%d,%d,%d) DOES NOT EXIST IN THE QUADTREE\n",
+			P->rect_name, P->center[X], P->center[Y], P->lenght[X], P->lenght[Y]);
 }
 
-static void delete_point(char args[][MAX_NAME_LEN + 1]) {
+static void delete_point(FILE *out, char args[][MAX_NAME_LEN + 1]) {
 	int px = atoi(args[0]);
 	int py = atoi(args[1]);
-	rectangle_t *search_rect, *point_rect, w;
+	rectangle_t *search_rect, point, *point_rect = &point, w;
 	int counter = 0;
 	w = mx_cif_tree->world;
 
-	point_rect = (rectangle_t *)malloc(sizeof(rectangle_t));
 	point_rect->center[X] = px;
 	point_rect->center[Y] = py;
 	point_rect->lenght[X] = point_rect->lenght[Y] = 0;
 	search_rect = cif_search(point_rect, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter);
 
 	if (search_rect != NULL)
-		delete_rectangle(search_rect->rect_name);
+		delete_rectangle(out, search_rect->rect_name, 0);
 	else {
 		if (trace)
-			printf("\n");
-			printf("POINT (%d,%d) NOT IN ANY RECTANGLE\n", px, py);
+			fprintf(out, "\n");
+			fprintf(out, "POINT (%d,%d) NOT IN ANY RECTANGLE\n", px, py);
 	}
 }
 
-static void move(char args[][MAX_NAME_LEN +1]) {
+static void move(FILE *out, char args[][MAX_NAME_LEN +1]) {
 	char *name = args[0];
 	int cx = atoi(args[1]);
 	int cy = atoi(args[2]);
-	rectangle_t *search_rect, *moved_rect, w;
-	bnode_t *node;
+	rectangle_t *P = find_rectangle(name), *moved_rect, w;
+	ref_t moved;
 	int counter = 0;
 	w = mx_cif_tree->world;
 
-	// Find the rectangle in the DB (BST) by its name
-	search_rect = (rectangle_t *)malloc(sizeof(rectangle_t));
-	search_rect->rect_name = name;
-	node = (bnode_t *)malloc(sizeof(bnode_t));
-	node->rect = search_rect;
-	node = find_btree(rect_tree, node);
-
-	moved_rect = (rectangle_t *)malloc(sizeof(rectangle_t));
-	*moved_rect = *(node->rect);
+	if (P == NULL) {
+		fprintf(out, "RECTANGLE %s DOES NOT EXIST\n", name);
+		return;
+	}
+	moved = pool_alloc(&rect_pool);
+	moved_rect = rect_at(moved);
+	*moved_rect = *P;
+	moved_rect->bson[LEFT] = moved_rect->bson[RIGHT] = 0; // the copy is not in the name tree
 	moved_rect->center[X] = moved_rect->center[X] + cx;
 	moved_rect->center[Y] = moved_rect->center[Y] + cy;
 
@@ -596,132 +1920,1385 @@ static void move(char args[][MAX_NAME_LEN +1]) {
 	rectangle_t *over_rect = cif_search(moved_rect, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter);
 	counter = 0;
 	if (trace)
-		printf("\n");
-	if (over_rect != NULL)
-		printf("RECTANGLE %s(%d,%d,%d,%d) OVERLAPS RECTANGLE %s(%d,%d,%d,%d)\n",
-			node->rect->rect_name, node->rect->center[X], node->rect->center[Y], node->rect->lenght[X], node->rect->lenght[Y],
+		fprintf(out, "\n");
+	if (over_rect != NULL) {
+		fprintf(out, "RECTANGLE %s(%d,%d,%d,%d) OVERLAPS RECTANGLE %s(%d,%d,%d,%d)\n",
+			P->rect_name, P->center[X], P->center[Y], P->lenght[X], P->lenght[Y],
 			over_rect->rect_name, over_rect->center[X], over_rect->center[Y], over_rect->lenght[X], over_rect->lenght[Y]);
+		pool_free(&rect_pool, moved);
+	}
 	else {
-		cif_delete(node->rect, mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter);
+		cif_delete(P, &mx_cif_tree->mx_cif_root, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y], &counter, 0);
 		counter = 0;
 		if (trace)
-			printf("\n");
-		cif_insert(moved_rect, mx_cif_tree, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y]);
+			fprintf(out, "\n");
+		cif_insert(moved, mx_cif_tree, w.center[X], w.center[Y], w.lenght[X], w.lenght[Y]);
 		if (trace)
-			printf("\n");
-		printf("RECTANGLE %s MOVED TO (%d,%d)\n", moved_rect->rect_name, moved_rect->center[X], moved_rect->center[Y]);
+			fprintf(out, "\n");
+		fprintf(out, "RECTANGLE %s MOVED TO (%d,%d)\n", moved_rect->rect_name, moved_rect->center[X], moved_rect->center[Y]);
 	}
 }
 
-static void decode_command(char *command, char args[][MAX_NAME_LEN + 1])
-{
-	if (strcmp(command, "INIT_QUADTREE") == 0)
-		init_quadtree(args);
-	else if (strcmp(command, "DISPLAY") == 0)
-		display();
-	else if (strcmp(command, "LIST_RECTANGLES") == 0)
-		list_rectangles();
-	else if (strcmp(command, "CREATE_RECTANGLE") == 0)
-		create_rectangle(args);
-	else if (strcmp(command, "SEARCH_POINT") == 0)
-		search_point(args);
-	else if (strcmp(command, "RECTANGLE_SEARCH") == 0)
-		rectangle_search(args);
-	else if (strcmp(command, "INSERT") == 0)
-		insert_rectangle(args);
-	else if (strcmp(command, "DELETE_RECTANGLE") == 0)
-		delete_rectangle(args);
-	else if (strcmp(command, "DELETE_POINT") == 0)
-		delete_point(args);
-	else if (strcmp(command, "MOVE") == 0)
-		move(args);
-	else if (strcmp(command, "TOUCH") == 0)
-		return;
-	else if (strcmp(command, "WITHIN") == 0)
-		return;
-	else if (strcmp(command, "HORIZ_NEIGHBOR") == 0 || strcmp(command, "VERT_NEIGHBOR") == 0)
-		return;
-	else if (strcmp(command, "NEAREST_RECTANGLE") == 0)
-		return;
-	else if (strcmp(command, "WINDOW") == 0)
-		return;
-	else if (strcmp(command, "NEAREST_NEIGHBOR") == 0)
-		return;
-	else if (strcmp(command, "LEXICALLY_GREATER_NEAREST_NEIGHBOR") == 0)
-		return;
-	else if (strcmp(command, "LABEL") == 0)
-		return;
-	else if (strcmp(command, "SPATIAL_JOIN") == 0)
-		return;
-	else
-		return;
-}
+static void memory_stats(FILE *out) {
+	long bytes = name_pool.bytes;
+	pool_t *pools[] = {&cnode_pool, &bnode_pool, &rect_pool};
+	int i, c;
 
-static void read_command(void)
-{
-	char c;
-	int i = 0, j=0, k=0;
+	for (i = 0; i < 3; i++) {
+		bytes += pools[i]->blocks * POOL_BLOCK * (long)pools[i]->size;
+		for (c = 0; c < POOL_COLUMNS; c++)
+			bytes += pools[i]->blocks * POOL_BLOCK * (long)pools[i]->column[c].size;
+	}
+	fprintf(out, "MEMORY: %ld QUADTREE NODES, %ld AXIS NODES, %ld RECTANGLES, %ld BYTES RESERVED\n",
+		cnode_pool.live, bnode_pool.live, rect_pool.live, bytes);
+}
 
-while(1){
-	char args[10][MAX_NAME_LEN + 1];
-	char input[100];
-	char command_name[100];
+static void latency_command(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	/*
+	** LATENCY() prints the latencies, LATENCY(OFF) stops timing the commands and
+	** LATENCY(ON) resumes it
+	*/
+	if (strcmp(args[0], "ON") == 0) {
+		latencies.recording = 1;
+		fprintf(out, "LATENCY RECORDING ENABLED\n");
+	} else if (strcmp(args[0], "OFF") == 0) {
+		latencies.recording = 0;
+		fprintf(out, "LATENCY RECORDING DISABLED\n");
+	} else
+		latency_report(&latencies, out);
+}
 
-	for (i =0; (c = getchar()) != '\n'; i++) {
-		input[i] = c;
-		if (c == EOF)
-			return;
-	}
-
-	i = 0;
-	while(input[i] != '(' && input[i] != ' ')
-	{
-		command_name[i] = input[i];
-		++i;
-	}
-	command_name[i] = '\0';
-
-	if (strcmp(command_name, "TRACE") != 0) {
-		++i;
-		while(input[i] != ')')
-		{
-			if(input[i] == ',')
-			{
-				args[j][k] = '\0';
-				++j;
-				k=0;
-			}
-			else
-			{
-				args[j][k] = input[i];
-				++k;
-				if (input[i+1] == ')')
-					args[j][k] = '\0';
-			}
-			++i;
-		}
+static void rect_region(rectangle_t *P, int lo[], int hi[]) {
+	lo[X] = P->center[X] - P->lenght[X];
+	lo[Y] = P->center[Y] - P->lenght[Y];
+	hi[X] = P->center[X] + P->lenght[X];
+	hi[Y] = P->center[Y] + P->lenght[Y];
+}
 
-		decode_command(command_name, args);
+static int join_order(rectangle_t *a, rectangle_t *b) {
+	/*
+	** Orders the rectangles of a join by name, and copies of a moved rectangle sharing a
+	** name by address, so that both engines report every pair the same way round
+	*/
+	int cmp = strcmp(a->rect_name, b->rect_name);
+
+	if (cmp != 0)
+		return cmp;
+	return (a < b) ? -1 : (a > b);
+}
+
+static int join_pair_compare(const void *a, const void *b) {
+	const join_pair_t *p = a, *q = b;
+	int cmp = join_order(p->rect[0], q->rect[0]);
+
+	return (cmp != 0) ? cmp : join_order(p->rect[1], q->rect[1]);
+}
+
+static int join_rect_compare(const void *a, const void *b) {
+	rectangle_t *p = ((const join_item_t *)a)->rect, *q = ((const join_item_t *)b)->rect;
+
+	return (p < q) ? -1 : (p > q);
+}
+
+static int join_low_y_compare(const void *a, const void *b) {
+	const join_item_t *p = a, *q = b;
+
+	return (p->lo[Y] < q->lo[Y]) ? -1 : (p->lo[Y] > q->lo[Y]);
+}
+
+static int join_start_compare(const void *a, const void *b) {
+	const join_item_t *p = *(join_item_t * const *)a, *q = *(join_item_t * const *)b;
+
+	if (p->lo[X] != q->lo[X])
+		return (p->lo[X] < q->lo[X]) ? -1 : 1;
+	return (p->rank < q->rank) ? -1 : (p->rank > q->rank);
+}
+
+static int join_end_compare(const void *a, const void *b) {
+	const join_item_t *p = *(join_item_t * const *)a, *q = *(join_item_t * const *)b;
+
+	if (p->hi[X] != q->hi[X])
+		return (p->hi[X] < q->hi[X]) ? -1 : 1;
+	return (p->rank < q->rank) ? -1 : (p->rank > q->rank);
+}
+
+static void join_add_pair(join_t *join, rectangle_t *a, rectangle_t *b) {
+	join_pair_t *pair;
+
+	if (join->pairs == join->cap) {
+		join->cap = (join->cap == 0) ? 256 : 2 * join->cap;
+		join->pair = (join_pair_t *)realloc(join->pair, join->cap * sizeof(join_pair_t));
+	}
+	pair = &join->pair[join->pairs++];
+	pair->rect[0] = (join_order(a, b) < 0) ? a : b;
+	pair->rect[1] = (join_order(a, b) < 0) ? b : a;
+}
+
+static void join_collect(join_t *join, ref_t root) {
+	/*
+	** Lists the rectangles stored in the quadtree, once each. Rectangles without area
+	** overlap nothing and are left out. Each one is held by an axis node of its own.
+	*/
+	walk_frame_t stack[WALK_STACK_SIZE];
+	join_item_t *item;
+	int top = 0, i, n = 0, V, Q;
+
+	join->n = 0;
+	join->item = NULL;
+	if (root == 0)
+		return;
+	join->item = (join_item_t *)malloc(bnode_pool.live * sizeof(join_item_t));
+	stack[top].is_axis = 0;
+	stack[top++].node = root;
+
+	while (top > 0) {
+		top--;
+		nodes_visited++;
+		if (stack[top].is_axis) {
+			bnode_t *B = bnode_at(stack[top].node);
+			rectangle_t *P = (B->rect != 0) ? rect_at(B->rect) : NULL;
+
+			if ((P != NULL) && (P->lenght[X] > 0) && (P->lenght[Y] > 0)) {
+				item = &join->item[n++];
+				item->rect = P;
+				rect_region(P, item->lo, item->hi);
+			}
+			for (V = LEFT; V <= RIGHT; V++)
+				if (B->bson[V] != 0) {
+					stack[top].is_axis = 1;
+					stack[top++].node = B->bson[V];
+				}
+		} else {
+			cnode_t *C = cnode_at(stack[top].node);
+
+			for (Q = NW; Q <= SE; Q++)
+				if (C->qson[Q] != 0) {
+					stack[top].is_axis = 0;
+					stack[top++].node = C->qson[Q];
+				}
+			for (V = Y; V >= X; V--)
+				if (C->bson[V] != 0) {
+					stack[top].is_axis = 1;
+					stack[top++].node = C->bson[V];
+				}
+		}
+	}
+
+	// The quadtree can hold a rectangle more than once
+	qsort(join->item, n, sizeof(join_item_t), join_rect_compare);
+	for (i = 0; i < n; i++)
+		if ((join->n == 0) || (join->item[i].rect != join->item[join->n - 1].rect))
+			join->item[join->n++] = join->item[i];
+}
+
+static void probe_join(join_t *join, ref_t root) {
+	/*
+	** Walks the quadtree once per rectangle for the rectangles overlapping it, skipping the
+	** subtrees whose bounding box misses it. Every pair is met from both of its rectangles
+	** and kept from the first one in join order.
+	*/
+	walk_frame_t stack[WALK_STACK_SIZE];
+	join_item_t *item;
+	rectangle_t *P;
+	summary_t *sum;
+	int top, i, V, Q;
+
+	for (i = 0; i < join->n; i++) {
+		item = &join->item[i];
+		top = 0;
+		stack[top].is_axis = 0;
+		stack[top++].node = root;
+
+		while (top > 0) {
+			top--;
+			nodes_visited++;
+			sum = node_sum(stack[top].is_axis, stack[top].node);
+			if (summary_misses_window(sum, item->lo, item->hi))
+				continue;
+
+			if (stack[top].is_axis) {
+				bnode_t *B = bnode_at(stack[top].node);
+
+				P = (B->rect != 0) ? rect_at(B->rect) : NULL;
+				if ((P != NULL) && (join_order(item->rect, P) < 0)
+					&& (P->center[X] - P->lenght[X] < item->hi[X]) && (P->center[X] + P->lenght[X] > item->lo[X])
+					&& (P->center[Y] - P->lenght[Y] < item->hi[Y]) && (P->center[Y] + P->lenght[Y] > item->lo[Y]))
+					join_add_pair(join, item->rect, P);
+				for (V = LEFT; V <= RIGHT; V++)
+					if (B->bson[V] != 0) {
+						stack[top].is_axis = 1;
+						stack[top++].node = B->bson[V];
+					}
+			} else {
+				cnode_t *C = cnode_at(stack[top].node);
+
+				for (Q = NW; Q <= SE; Q++)
+					if (C->qson[Q] != 0) {
+						stack[top].is_axis = 0;
+						stack[top++].node = C->qson[Q];
+					}
+				for (V = Y; V >= X; V--)
+					if (C->bson[V] != 0) {
+						stack[top].is_axis = 1;
+						stack[top++].node = C->bson[V];
+					}
+			}
+		}
+	}
+}
+
+static void interval_set(int reach[], int leaves, int leaf, int hi) {
+	int i = leaves + leaf;
+
+	reach[i] = hi;
+	for (i = i / 2; i >= 1; i = i / 2)
+		reach[i] = (reach[2 * i] > reach[2 * i + 1]) ? reach[2 * i] : reach[2 * i + 1];
+}
+
+static void sweep_join(join_t *join) {
+	/*
+	** Plane sweep over x. The rectangles are ranked by their lower y, and the active ones
+	** (those whose x extent contains the sweep line) are kept in a max tree over the ranks
+	** holding their upper y. A rectangle entering the sweep overlaps the active rectangles
+	** whose lower y is below its upper y, a prefix of the ranks, and whose upper y is above
+	** its lower y, which the max tree finds without visiting the others. Every pair is
+	** found once, when its second rectangle enters.
+	*/
+	join_item_t **start, **end, *q;
+	int *reach;
+	int stack[2 * MAX_DEPTH];
+	int leaves = 1, n = join->n, s, e = 0, i, top, lo, hi, mid, depth, first, width;
+
+	qsort(join->item, n, sizeof(join_item_t), join_low_y_compare);
+	start = (join_item_t **)malloc(n * sizeof(join_item_t *));
+	end = (join_item_t **)malloc(n * sizeof(join_item_t *));
+	for (i = 0; i < n; i++) {
+		join->item[i].rank = i;
+		start[i] = end[i] = &join->item[i];
+	}
+	qsort(start, n, sizeof(join_item_t *), join_start_compare);
+	qsort(end, n, sizeof(join_item_t *), join_end_compare);
+
+	while (leaves < n)
+		leaves = 2 * leaves;
+	reach = (int *)malloc(2 * leaves * sizeof(int));
+	for (i = 0; i < 2 * leaves; i++)
+		reach[i] = INT_MIN;
+
+	for (s = 0; s < n; s++) {
+		q = start[s];
+		// Rectangles ending at or before the sweep line leave (extents are half-open)
+		while ((e < n) && (end[e]->hi[X] <= q->lo[X]))
+			interval_set(reach, leaves, end[e++]->rank, INT_MIN);
+
+		// Ranks [0, hi) have a lower y below the upper y of q
+		lo = 0;
+		hi = n;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (join->item[mid].lo[Y] < q->hi[Y])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		top = 0;
+		stack[top++] = 1;
+		while (top > 0) {
+			i = stack[--top];
+			depth = 31 - __builtin_clz(i);
+			width = leaves >> depth;
+			first = (i - (1 << depth)) * width;
+			if ((first >= hi) || (reach[i] <= q->lo[Y]))
+				continue;
+			if (i >= leaves)
+				join_add_pair(join, join->item[first].rect, q->rect);
+			else {
+				stack[top++] = 2 * i + 1;
+				stack[top++] = 2 * i;
+			}
+		}
+
+		interval_set(reach, leaves, q->rank, q->hi[Y]);
+	}
+
+	free(reach);
+	free(end);
+	free(start);
+}
+
+static void spatial_join(FILE *out, char args[][MAX_NAME_LEN + 1]) {
+	/*
+	** SPATIAL_JOIN([SWEEP|PROBE]): reports every pair of overlapping rectangles in the
+	** quadtree, using the engine given or else the sweep. The sweep was measured faster
+	** than probing, by 3% to 55%, on uniform random layers of 100 to a million rectangles
+	** with sides of 16 to 100000 cells; clustered layers have not been measured.
+	*/
+	ref_t root = mx_cif_tree->mx_cif_root;
+	join_t join;
+	join_engine engine;
+	int i, n;
+
+	join_collect(&join, root);
+	join.pairs = join.cap = 0;
+	join.pair = NULL;
+	if (strcmp(args[0], "SWEEP") == 0)
+		engine = SWEEP_JOIN;
+	else if (strcmp(args[0], "PROBE") == 0)
+		engine = PROBE_JOIN;
+	else
+		engine = SWEEP_JOIN;
+
+	if (engine == SWEEP_JOIN)
+		sweep_join(&join);
+	else {
+		keep_summaries();
+		probe_join(&join, root);
+	}
+
+	// Probing meets a pair twice when one of its rectangles is stored twice in the quadtree
+	if (join.pairs > 0)
+		qsort(join.pair, join.pairs, sizeof(join_pair_t), join_pair_compare);
+	n = 0;
+	for (i = 0; i < join.pairs; i++)
+		if ((n == 0) || (join_pair_compare(&join.pair[i], &join.pair[n - 1]) != 0))
+			join.pair[n++] = join.pair[i];
+	join.pairs = n;
+
+	for (i = 0; i < join.pairs; i++)
+		fprintf(out, "RECTANGLE %s(%d,%d,%d,%d) OVERLAPS RECTANGLE %s(%d,%d,%d,%d)\n",
+			join.pair[i].rect[0]->rect_name, join.pair[i].rect[0]->center[X], join.pair[i].rect[0]->center[Y],
+			join.pair[i].rect[0]->lenght[X], join.pair[i].rect[0]->lenght[Y],
+			join.pair[i].rect[1]->rect_name, join.pair[i].rect[1]->center[X], join.pair[i].rect[1]->center[Y],
+			join.pair[i].rect[1]->lenght[X], join.pair[i].rect[1]->lenght[Y]);
+	fprintf(out, "SPATIAL JOIN FOUND %d OVERLAPPING PAIRS BY %s\n", join.pairs, engine == SWEEP_JOIN ? "PLANE SWEEP" : "QUADTREE PROBING");
+
+	free(join.pair);
+	free(join.item);
+}
+
+static void decode_command(FILE *out, char *command, char args[][MAX_NAME_LEN + 1])
+{
+	if (strcmp(command, "INIT_QUADTREE") == 0)
+		init_quadtree(out, args);
+	else if (strcmp(command, "DISPLAY") == 0)
+		display(out);
+	else if (strcmp(command, "LIST_RECTANGLES") == 0)
+		list_rectangles(out);
+	else if (strcmp(command, "CREATE_RECTANGLE") == 0)
+		create_rectangle(out, args);
+	else if (strcmp(command, "SEARCH_POINT") == 0)
+		search_point(out, args);
+	else if (strcmp(command, "RECTANGLE_SEARCH") == 0)
+		rectangle_search(out, args);
+	else if (strcmp(command, "INSERT") == 0)
+		insert_rectangle(out, args);
+	else if (strcmp(command, "DELETE_RECTANGLE") == 0)
+		delete_rectangle(out, args, strcmp(args[1], "EXACT") == 0);
+	else if (strcmp(command, "DELETE_POINT") == 0)
+		delete_point(out, args);
+	else if (strcmp(command, "MOVE") == 0)
+		move(out, args);
+	else if (strcmp(command, "TOUCH") == 0)
+		return;
+	else if (strcmp(command, "WITHIN") == 0)
+		return;
+	else if (strcmp(command, "HORIZ_NEIGHBOR") == 0 || strcmp(command, "VERT_NEIGHBOR") == 0)
+		return;
+	else if (strcmp(command, "NEAREST_RECTANGLE") == 0)
+		return;
+	else if (strcmp(command, "WINDOW") == 0)
+		window(out, args);
+	else if (strcmp(command, "FETCH") == 0)
+		fetch(out, args);
+	else if (strcmp(command, "COUNT_WINDOW") == 0)
+		count_window(out, args);
+	else if (strcmp(command, "AREA_WINDOW") == 0)
+		area_window(out, args);
+	else if (strcmp(command, "CACHE") == 0)
+		cache_command(out, args);
+	else if (strcmp(command, "CACHE_STATS") == 0)
+		cache_stats(out);
+	else if (strcmp(command, "MEMORY") == 0)
+		memory_stats(out);
+	else if (strcmp(command, "LATENCY") == 0)
+		latency_command(out, args);
+	else if (strcmp(command, "NEAREST_NEIGHBOR") == 0)
+		return;
+	else if (strcmp(command, "LEXICALLY_GREATER_NEAREST_NEIGHBOR") == 0)
+		return;
+	else if (strcmp(command, "LABEL") == 0)
+		return;
+	else if (strcmp(command, "SPATIAL_JOIN") == 0)
+		spatial_join(out, args);
+	else if (strcmp(command, "SYNC") == 0) // closes every reply of a shard worker
+		fprintf(out, "SYNC\n");
+	else
+		return;
+}
+
+static void gather_routed(unsigned long workers) {
+	int w;
+
+	for (w = 0; w < shard_router.n; w++)
+		if (workers & (1UL << w))
+			shard_receive(&shard_router, w, &shard_reply[w]);
+}
+
+static void scatter_gather(unsigned long workers, command_t *cmd) {
+	/*
+	** All workers get the command before any reply is read, so they run it in parallel
+	*/
+	int w;
+
+	for (w = 0; w < shard_router.n; w++)
+		if (workers & (1UL << w))
+			shard_send(&shard_router, w, cmd);
+	gather_routed(workers);
+}
+
+typedef struct {
+	char *text;
+	unsigned long long key[5]; //Place of the rectangle in a pre-order walk, see traversal_key
+	int worker; //Worker the piece came from
+} token_t; //Rectangle or name from a worker reply
+
+token_t *tokens; //Pieces of the gathered replies, merged by merge_tokens
+int token_count, token_cap;
+
+typedef struct {
+	int open; //Set while FETCH may still page through the window
+	int lo[NDIR_1D]; //Query window is [lo, hi) on each axis
+	int hi[NDIR_1D];
+	char **item; //Rectangles of the window in traversal order, copied from the worker replies
+	int n;
+	int next; //First rectangle not printed yet
+} merged_window_t; //Result of the last WINDOW on a sharded quadtree, paged by FETCH
+
+merged_window_t merged_window;
+
+static void add_tokens(char *text, char sep, int worker) {
+	/*
+	** Splits text in place at each sep and appends the non-empty pieces to tokens
+	*/
+	char *end;
+
+	while (*text != '\0') {
+		if ((end = strchr(text, sep)) != NULL)
+			*end = '\0';
+		if (*text != '\0') {
+			if (token_count == token_cap) {
+				token_cap = token_cap ? 2 * token_cap : 64;
+				tokens = (token_t *)realloc(tokens, token_cap * sizeof(token_t));
+			}
+			tokens[token_count].text = text;
+			tokens[token_count].worker = worker;
+			token_count++;
+		}
+		if (end == NULL)
+			break;
+		text = end + 1;
+	}
+}
+
+static void traversal_key(rectangle_t *P, unsigned long long key[]) {
+	/*
+	** Locates the axis node insert_axis stores P in: key[0] and key[1] are the quadrant
+	** path to its quadtree node and the length of that path, encoded as by insert_path_key,
+	** key[2] is the axis tree, and key[3] and key[4] the path of sons in that tree, one bit
+	** per level from the most significant end, and its length. Ordering keys word by word
+	** orders the nodes the way the pre-order walks of cursor_next and DISPLAY visit them.
+	*/
+	int Sx[] = {-1, 1, -1, 1};
+	int Sy[] = {1, 1, -1, -1};
+	int F[] = {-1, 1};
+	rectangle_t w = mx_cif_tree->world;
+	int Cx = w.center[X], Cy = w.center[Y], Lx = w.lenght[X], Ly = w.lenght[Y], Cv, Lv, depth = 0;
+	quadrant Q;
+	direction D;
+	axis V;
+
+	key[0] = 0;
+	while ((depth < MAX_DEPTH) && (bin_compare(P, Cx, X) != BOTH) && (bin_compare(P, Cy, Y) != BOTH)) {
+		Q = cif_compare(P, Cx, Cy);
+		key[0] |= (unsigned long long)Q << (2 * (MAX_DEPTH - 1 - depth));
+		depth++;
+		Lx = Lx / 2;
+		Ly = Ly / 2;
+		Cx = Cx + Sx[Q] * Lx;
+		Cy = Cy + Sy[Q] * Ly;
+	}
+	key[1] = depth;
+
+	V = (bin_compare(P, Cx, X) == BOTH) ? Y : X;
+	Cv = (V == X) ? Cx : Cy;
+	Lv = (V == X) ? Lx : Ly;
+	key[2] = V;
+	key[3] = 0;
+	depth = 0;
+	while ((depth < MAX_DEPTH) && ((D = bin_compare(P, Cv, V)) != BOTH)) {
+		key[3] |= (unsigned long long)D << (MAX_DEPTH - 1 - depth);
+		depth++;
+		Lv = Lv / 2;
+		Cv = Cv + F[D] * Lv;
+	}
+	key[4] = depth;
+}
+
+static void place_window_token(token_t *t) {
+	rectangle_t P;
+
+	memset(t->key, 0, sizeof(t->key));
+	if (sscanf(strchr(t->text, '('), "(%d,%d,%d,%d)", &P.center[X], &P.center[Y], &P.lenght[X], &P.lenght[Y]) == 4)
+		traversal_key(&P, t->key);
+}
+
+static void place_display_token(token_t *t) {
+	rectangle_t *P = find_rectangle(t->text);
+
+	memset(t->key, 0, sizeof(t->key));
+	if (P != NULL)
+		traversal_key(P, t->key);
+}
+
+static int token_compare(const void *a, const void *b) {
+	const token_t *s = a, *t = b;
+	int i;
+
+	for (i = 0; i < 5; i++)
+		if (s->key[i] != t->key[i])
+			return (s->key[i] < t->key[i]) ? -1 : 1;
+	return strcmp(s->text, t->text);
+}
+
+static void merge_tokens(void (*place)(token_t *)) {
+	/*
+	** Puts the tokens in the order a single quadtree reports them, by the node insert_axis
+	** puts each rectangle in. A rectangle overlapping the parts of several workers is
+	** stored by each of them, so it comes back more than once; it is kept as many times as
+	** the worker returning it most often has it (a deletion can leave a rectangle off its
+	** own node, so that inserting it again stores it twice). Rectangles displacing each
+	** other from one axis node can all survive on different workers; they are kept side by
+	** side, in name order.
+	*/
+	int seen[MAX_SHARDS];
+	int i, j, w, copies, kept = 0;
+
+	for (i = 0; i < token_count; i++)
+		place(&tokens[i]);
+	qsort(tokens, token_count, sizeof(token_t), token_compare);
+	for (i = 0; i < token_count; i = j) {
+		memset(seen, 0, sizeof(seen));
+		copies = 0;
+		for (j = i; (j < token_count) && (token_compare(&tokens[j], &tokens[i]) == 0); j++) {
+			w = tokens[j].worker;
+			if (++seen[w] > copies)
+				copies = seen[w];
+		}
+		while (copies-- > 0)
+			tokens[kept++] = tokens[i++];
+	}
+	token_count = kept;
+}
+
+static unsigned long send_window(command_t *query, int lo[], int hi[]) {
+	/*
+	** Sends the window [lo, hi) of query to every worker owning a part of the world the
+	** window meets, and returns those workers
+	*/
+	command_t cmd = *query;
+	unsigned long workers;
+	int w;
+
+	strcpy(cmd.name, "WINDOW");
+	cmd.args[4][0] = '\0'; // no paging, the router pages the merged window itself
+
+	workers = shard_workers(&shard_router, shard_router.bound, lo, hi, 1);
+	for (w = 0; w < shard_router.n; w++)
+		if (workers & (1UL << w))
+			shard_send(&shard_router, w, &cmd);
+	return workers;
+}
+
+static void collect_window(unsigned long workers) {
+	/*
+	** Collects in tokens the rectangles of the window replies of workers, read into
+	** shard_reply
+	*/
+	char *list;
+	int w;
+
+	token_count = 0;
+	for (w = 0; w < shard_router.n; w++)
+		if ((workers & (1UL << w)) && (strncmp(shard_reply[w].text, "RECTANGLES IN WINDOW", 20) == 0)) {
+			list = strstr(shard_reply[w].text, "): ") + 3;
+			list[strcspn(list, "\n")] = '\0';
+			add_tokens(list, ' ', w);
+		}
+	merge_tokens(place_window_token);
+}
+
+static void open_merged_window(int lo[], int hi[]) {
+	/*
+	** Keeps a copy of the merged window for FETCH, as the worker replies are overwritten
+	*/
+	int i;
+
+	for (i = 0; i < merged_window.n; i++)
+		free(merged_window.item[i]);
+	merged_window.item = (char **)realloc(merged_window.item, (token_count + 1) * sizeof(char *));
+	for (i = 0; i < token_count; i++)
+		merged_window.item[i] = strdup(tokens[i].text);
+	merged_window.n = token_count;
+	merged_window.next = 0;
+	merged_window.open = 1;
+	memcpy(merged_window.lo, lo, sizeof(merged_window.lo));
+	memcpy(merged_window.hi, hi, sizeof(merged_window.hi));
+}
+
+static char *merged_window_next(void) {
+	if (merged_window.next < merged_window.n)
+		return merged_window.item[merged_window.next++];
+	merged_window.open = 0;
+	return NULL;
+}
+
+static void print_merged_page(FILE *out, int limit, int first_page) {
+	/*
+	** Prints up to limit rectangles of merged_window (all of them when limit <= 0), the
+	** way print_window_page does
+	*/
+	merged_window_t *win = &merged_window;
+	char *rect;
+	int count = 0;
+
+	while (((limit <= 0) || (count < limit)) && ((rect = merged_window_next()) != NULL)) {
+		if (count == 0)
+			fprintf(out, "RECTANGLES IN WINDOW (%d,%d,%d,%d): ", win->lo[X], win->lo[Y], win->hi[X] - win->lo[X], win->hi[Y] - win->lo[Y]);
+		fprintf(out, "%s ", rect);
+		count++;
+	}
+
+	if (count > 0)
+		fprintf(out, "\n");
+	else
+		fprintf(out, "NO %sRECTANGLES IN WINDOW (%d,%d,%d,%d)\n", first_page ? "" : "MORE ",
+			win->lo[X], win->lo[Y], win->hi[X] - win->lo[X], win->hi[Y] - win->lo[Y]);
+}
+
+static void window_region(command_t *cmd, int lo[], int hi[]) {
+	lo[X] = atoi(cmd->args[0]);
+	lo[Y] = atoi(cmd->args[1]);
+	hi[X] = lo[X] + atoi(cmd->args[2]);
+	hi[Y] = lo[Y] + atoi(cmd->args[3]);
+}
+
+static void route_window(FILE *out, command_t *cmd) {
+	int lo[NDIR_1D], hi[NDIR_1D];
+	unsigned long workers;
+
+	window_region(cmd, lo, hi);
+	workers = send_window(cmd, lo, hi);
+	gather_routed(workers);
+	collect_window(workers);
+	open_merged_window(lo, hi);
+	print_merged_page(out, atoi(cmd->args[4]), 1);
+}
+
+static void print_window_total(FILE *out, command_t *cmd) {
+	/*
+	** Prints COUNT_WINDOW or AREA_WINDOW from the rectangles collected in tokens
+	*/
+	int lo[NDIR_1D], hi[NDIR_1D], i, cx, cy, lx, ly;
+	long area = 0;
+
+	window_region(cmd, lo, hi);
+	if (strcmp(cmd->name, "COUNT_WINDOW") == 0)
+		fprintf(out, "WINDOW (%d,%d,%d,%d) CONTAINS %d RECTANGLES\n", lo[X], lo[Y], hi[X] - lo[X], hi[Y] - lo[Y], token_count);
+	else {
+		for (i = 0; i < token_count; i++)
+			if (sscanf(strchr(tokens[i].text, '('), "(%d,%d,%d,%d)", &cx, &cy, &lx, &ly) == 4)
+				area += (long)(2 * lx) * (2 * ly);
+		fprintf(out, "RECTANGLES IN WINDOW (%d,%d,%d,%d) HAVE TOTAL AREA %ld\n", lo[X], lo[Y], hi[X] - lo[X], hi[Y] - lo[Y], area);
+	}
+}
+
+static void route_fetch(FILE *out, command_t *cmd) {
+	if (!merged_window.open)
+		fprintf(out, "NO OPEN WINDOW\n");
+	else
+		print_merged_page(out, atoi(cmd->args[0]), 0);
+}
+
+static void route_display(FILE *out, command_t *cmd) {
+	/*
+	** The frame is drawn by worker 0; the rectangle names of all workers follow it
+	*/
+	unsigned long all = (1UL << shard_router.n) - 1;
+	char *names;
+	int w, i;
+
+	scatter_gather(all, cmd);
+	names = shard_reply[0].text;
+	while ((*names == '$') || (strncmp(names, "LD(", 3) == 0) || (strncmp(names, "DR(", 3) == 0))
+		names += strcspn(names, "\n") + 1;
+	fwrite(shard_reply[0].text, 1, names - shard_reply[0].text, out);
+
+	token_count = 0;
+	for (w = 0; w < shard_router.n; w++) {
+		names = shard_reply[w].text;
+		while ((*names == '$') || (strncmp(names, "LD(", 3) == 0) || (strncmp(names, "DR(", 3) == 0))
+			names += strcspn(names, "\n") + 1;
+		add_tokens(names, '\n', w);
+		if ((token_count > 0) && (strcmp(tokens[token_count - 1].text, "EP") == 0))
+			token_count--;
+	}
+	merge_tokens(place_display_token);
+	for (i = 0; i < token_count; i++)
+		fprintf(out, "%s\n", tokens[i].text);
+	fprintf(out, "EP\n");
+}
+
+static int pair_name_compare(char *a, char *b) {
+	/*
+	** Compares the rectangle names a and b start with, each ending at '('
+	*/
+	size_t m = strcspn(a, "("), n = strcspn(b, "(");
+	int cmp = strncmp(a, b, m < n ? m : n);
+
+	return (cmp != 0) ? cmp : (m > n) - (m < n);
+}
+
+static int pair_line_compare(const void *a, const void *b) {
+	char *s = ((const token_t *)a)->text, *t = ((const token_t *)b)->text;
+	char *sep = " OVERLAPS RECTANGLE ";
+	int cmp = pair_name_compare(s + strlen("RECTANGLE "), t + strlen("RECTANGLE "));
+
+	if (cmp == 0)
+		cmp = pair_name_compare(strstr(s, sep) + strlen(sep), strstr(t, sep) + strlen(sep));
+	return (cmp != 0) ? cmp : strcmp(s, t);
+}
+
+static void route_join(FILE *out, command_t *cmd) {
+	/*
+	** Two overlapping rectangles are both stored by the worker owning a point of their
+	** overlap, so every pair is found by some worker. The workers all use the engine
+	** spatial_join would.
+	*/
+	unsigned long all = (1UL << shard_router.n) - 1;
+	command_t join = *cmd;
+	join_engine engine;
+	int w, i, n;
+
+	engine = (strcmp(cmd->args[0], "PROBE") == 0) ? PROBE_JOIN : SWEEP_JOIN;
+	strcpy(join.args[0], engine == SWEEP_JOIN ? "SWEEP" : "PROBE");
+	join.args[1][0] = '\0';
+	scatter_gather(all, &join);
+
+	token_count = 0;
+	for (w = 0; w < shard_router.n; w++) {
+		add_tokens(shard_reply[w].text, '\n', w);
+		if ((token_count > 0) && (strncmp(tokens[token_count - 1].text, "SPATIAL JOIN FOUND ", 19) == 0))
+			token_count--;
+	}
+	if (token_count > 0)
+		qsort(tokens, token_count, sizeof(token_t), pair_line_compare);
+	n = 0;
+	for (i = 0; i < token_count; i++)
+		if ((n == 0) || (strcmp(tokens[i].text, tokens[n - 1].text) != 0))
+			tokens[n++] = tokens[i];
+
+	for (i = 0; i < n; i++)
+		fprintf(out, "%s\n", tokens[i].text);
+	fprintf(out, "SPATIAL JOIN FOUND %d OVERLAPPING PAIRS BY %s\n", n, engine == SWEEP_JOIN ? "PLANE SWEEP" : "QUADTREE PROBING");
+}
+
+unsigned int migrate_from[MAX_SHARDS + 1]; //Worker ranges before a rebalance
+int migrated; //Rectangle copies moved by the current rebalance
+
+static void migrate_rectangle(FILE *out, rectangle_t *P) {
+	/*
+	** Moves P to the workers owning its region after a rebalance
+	*/
+	command_t add, drop;
+	unsigned long before, after;
+	int lo[NDIR_1D], hi[NDIR_1D], w;
+
+	if (!P->placed)
+		return;
+
+	rect_region(P, lo, hi);
+	before = shard_workers(&shard_router, migrate_from, lo, hi, 0);
+	after = shard_workers(&shard_router, shard_router.bound, lo, hi, 0);
+
+	memset(&add, 0, sizeof(add));
+	strcpy(add.name, "INSERT");
+	strcpy(add.args[0], P->rect_name);
+	memset(&drop, 0, sizeof(drop));
+	strcpy(drop.name, "DELETE_RECTANGLE");
+	strcpy(drop.args[0], P->rect_name);
+	strcpy(drop.args[1], "EXACT");
+
+	for (w = 0; w < shard_router.n; w++)
+		if ((after & ~before) & (1UL << w))
+			shard_send(&shard_router, w, &add);
+		else if ((before & ~after) & (1UL << w))
+			shard_send(&shard_router, w, &drop);
+	for (w = 0; w < shard_router.n; w++)
+		if ((after ^ before) & (1UL << w)) {
+			shard_receive(&shard_router, w, &shard_reply[w]);
+			migrated++;
+		}
+}
+
+static void rebalance_shards(FILE *out) {
+	memcpy(migrate_from, shard_router.bound, sizeof(migrate_from));
+	shard_rebalance(&shard_router);
+	migrated = 0;
+	walk_in_order(out, rect_tree, migrate_rectangle);
+	fprintf(out, "SHARDS REBALANCED: %d RECTANGLE COPIES MIGRATED\n", migrated);
+}
+
+static void shard_stats(FILE *out) {
+	/*
+	** A cell split between workers is listed by each of them, with the share of its load
+	** their keys cover
+	*/
+	unsigned int *bound = shard_router.bound, lo, hi;
+	unsigned long load;
+	int w, c;
+
+	for (w = 0; w < shard_router.n; w++) {
+		if (bound[w] == bound[w + 1]) {
+			fprintf(out, "SHARD %d: NO CELLS\n", w);
+			continue;
+		}
+		load = 0;
+		for (c = bound[w] / SHARD_CELL_KEYS; c * SHARD_CELL_KEYS < bound[w + 1]; c++) {
+			lo = (bound[w] > c * SHARD_CELL_KEYS) ? bound[w] : c * SHARD_CELL_KEYS;
+			hi = (bound[w + 1] < (c + 1) * SHARD_CELL_KEYS) ? bound[w + 1] : (c + 1) * SHARD_CELL_KEYS;
+			load += shard_router.load[c] * (hi - lo) / SHARD_CELL_KEYS;
+		}
+		fprintf(out, "SHARD %d: CELLS %u-%u, LOAD %lu\n", w, bound[w] / SHARD_CELL_KEYS, (bound[w + 1] - 1) / SHARD_CELL_KEYS, load);
+	}
+}
+
+static unsigned long route_send(command_t *cmd) {
+	/*
+	** Sends a command answered from the replies of the workers it goes to alone, and
+	** returns those workers: none for a rectangle that does not exist. route_reply prints
+	** the answer once their replies are read.
+	*/
+	command_t sent = *cmd;
+	unsigned long workers;
+	int lo[NDIR_1D], hi[NDIR_1D], w;
+	rectangle_t *P;
+
+	if ((strcmp(cmd->name, "COUNT_WINDOW") == 0) || (strcmp(cmd->name, "AREA_WINDOW") == 0)) {
+		window_region(cmd, lo, hi);
+		return send_window(cmd, lo, hi);
+	}
+	// The router keeps the names, and every worker creates the rectangle as well
+	if (strcmp(cmd->name, "CREATE_RECTANGLE") == 0) {
+		add_rectangle(cmd->args);
+		workers = (1UL << shard_router.n) - 1;
+	}
+	else {
+		if (strcmp(cmd->name, "SEARCH_POINT") == 0) {
+			lo[X] = hi[X] = atoi(cmd->args[0]);
+			lo[Y] = hi[Y] = atoi(cmd->args[1]);
+		}
+		else if ((P = find_rectangle(cmd->args[0])) != NULL)
+			rect_region(P, lo, hi);
+		else
+			return 0;
+		workers = shard_workers(&shard_router, shard_router.bound, lo, hi, 1);
+	}
+
+	// A worker deleting the first rectangle it finds intersecting P could pick one the others do not hold
+	if (strcmp(cmd->name, "DELETE_RECTANGLE") == 0)
+		strcpy(sent.args[1], "EXACT");
+	for (w = 0; w < shard_router.n; w++)
+		if (workers & (1UL << w))
+			shard_send(&shard_router, w, &sent);
+	return workers;
+}
+
+static void route_reply(FILE *out, command_t *cmd, unsigned long workers) {
+	/*
+	** Prints the answer to a command route_send sent to workers, whose replies are in
+	** shard_reply. A rectangle search is answered by a worker finding an overlap if one
+	** does. Every worker holding a copy of P deletes that copy and nothing else, so their
+	** replies only differ where an overlapping insert displaced a copy; P is deleted if
+	** any copy was.
+	*/
+	char *name = cmd->name;
+	rectangle_t *P;
+	int w, found = -1;
+
+	if ((strcmp(name, "COUNT_WINDOW") == 0) || (strcmp(name, "AREA_WINDOW") == 0)) {
+		collect_window(workers);
+		print_window_total(out, cmd);
+		return;
+	}
+	if ((strcmp(name, "SEARCH_POINT") == 0) || (strcmp(name, "CREATE_RECTANGLE") == 0)) {
+		fputs(shard_reply[__builtin_ctzl(workers)].text, out);
+		return;
+	}
+	if ((P = find_rectangle(cmd->args[0])) == NULL) {
+		fprintf(out, "RECTANGLE %s DOES NOT EXIST\n", cmd->args[0]);
+		return;
+	}
+
+	for (w = 0; w < shard_router.n; w++) {
+		if (!(workers & (1UL << w)))
+			continue;
+		if (strcmp(name, "DELETE_RECTANGLE") == 0) {
+			if (strstr(shard_reply[w].text, ") DELETED\n") != NULL)
+				found = w;
+			else if (strstr(shard_reply[w].text, ") DOES NOT EXIST IN THE QUADTREE\n") == NULL) {
+				fprintf(stderr, "quadtree: shard %d answered DELETE_RECTANGLE(%s) with %s", w, P->rect_name, shard_reply[w].text);
+				exit(1);
+			}
+		}
+		else if ((strcmp(name, "RECTANGLE_SEARCH") == 0) && (found < 0) && (strstr(shard_reply[w].text, " OVERLAPS ") != NULL))
+			found = w;
+	}
+	w = (found >= 0) ? found : __builtin_ctzl(workers);
+
+	if ((strcmp(name, "INSERT") == 0) && (strstr(shard_reply[w].text, ") INSERTED\n") != NULL))
+		P->placed = 1;
+	else if ((strcmp(name, "DELETE_RECTANGLE") == 0) && (found >= 0))
+		P->placed = 0;
+	fputs(shard_reply[w].text, out);
+}
+
+static inline int routed_alone(command_t *command) {
+	/*
+	** Whether command is answered by route_send and route_reply
+	*/
+	char *name = command->name;
+
+	return (strcmp(name, "CREATE_RECTANGLE") == 0) || (strcmp(name, "INSERT") == 0) || (strcmp(name, "DELETE_RECTANGLE") == 0) || (strcmp(name, "RECTANGLE_SEARCH") == 0)
+		|| (strcmp(name, "SEARCH_POINT") == 0) || (strcmp(name, "COUNT_WINDOW") == 0) || (strcmp(name, "AREA_WINDOW") == 0);
+}
+
+static void route_command(FILE *out, command_t *cmd) {
+	/*
+	** Runs a command on a sharded quadtree. The router keeps the rectangle names and the
+	** world, and every worker stores the rectangles overlapping its part of the world: a
+	** point query is answered by the worker owning the point, region queries and joins are
+	** gathered from the workers owning the region, and the copies of a rectangle change
+	** together. The router pages merged windows for FETCH itself.
+	*/
+	unsigned long workers, all = (1UL << shard_router.n) - 1;
+	int width;
+	char *name = cmd->name;
+
+	if (strcmp(name, "INIT_QUADTREE") == 0) {
+		decode_command(out, name, cmd->args);
+		scatter_gather(all, cmd);
+		width = atoi(cmd->args[0]);
+		if ((width >= 1) && (width <= MAX_WIDTH))
+			shard_router.width = width;
+	}
+	else if (strcmp(name, "LIST_RECTANGLES") == 0)
+		list_rectangles(out);
+	else if (routed_alone(cmd)) {
+		workers = route_send(cmd);
+		gather_routed(workers);
+		route_reply(out, cmd, workers);
+	}
+	else if (strcmp(name, "WINDOW") == 0)
+		route_window(out, cmd);
+	else if (strcmp(name, "FETCH") == 0)
+		route_fetch(out, cmd);
+	else if (strcmp(name, "DISPLAY") == 0)
+		route_display(out, cmd);
+	else if (strcmp(name, "SPATIAL_JOIN") == 0)
+		route_join(out, cmd);
+	else if (strcmp(name, "REBALANCE") == 0)
+		rebalance_shards(out);
+	else if (strcmp(name, "SHARD_STATS") == 0)
+		shard_stats(out);
+	else if (strcmp(name, "LATENCY") == 0)
+		latency_command(out, cmd->args);
+	else if ((strcmp(name, "DELETE_POINT") == 0) || (strcmp(name, "MOVE") == 0)
+		|| (strcmp(name, "CACHE") == 0) || (strcmp(name, "CACHE_STATS") == 0))
+		fprintf(out, "%s IS NOT SUPPORTED BY A SHARDED MX-CIF QUADTREE\n", name);
+}
+
+static void run_query_chunk(void *job, int chunk) {
+	/*
+	** Runs one chunk of the queued queries, printing to a buffer of its own
+	*/
+	char **text = job;
+	size_t len;
+	int first = chunk * queued_queries / QUERY_CHUNKS, last = (chunk + 1) * queued_queries / QUERY_CHUNKS, i;
+	FILE *out = open_memstream(&text[chunk], &len);
+
+	unsigned long start = 0, end;
+
+	if (latencies.recording)
+		start = latency_ticks();
+	for (i = first; i < last; i++) {
+		nodes_visited = 0;
+		current_query = i;
+		if (strcmp(query_queue[i].name, "SEARCH_POINT") == 0)
+			search_point(out, query_queue[i].args);
+		else
+			rectangle_search(out, query_queue[i].args);
+		if (latencies.recording) {
+			end = latency_ticks();
+			query_ticks[i] = end - start;
+			query_nodes[i] = nodes_visited;
+			start = end;
+		}
+	}
+	fclose(out);
+}
+
+static void probe_queries(void) {
+	/*
+	** Makes the cache lookups and stores of the queued queries in order on the writer, so
+	** that the hits, misses and evictions are those of running them one by one. A query
+	** hitting an entry stored earlier in the same run is searched again, which finds the
+	** same rectangle, as the quadtree does not change during the run.
+	*/
+	rectangle_t point, *P;
+	cache_entry_t *e;
+	query_kind kind;
+	int lo[NDIR_1D], hi[NDIR_1D], i;
+
+	for (i = 0; i < queued_queries; i++) {
+		query_cached[i] = 0;
+		query_entry[i] = -1;
+		if (!cache_usable())
+			continue;
+
+		if (strcmp(query_queue[i].name, "SEARCH_POINT") == 0) {
+			kind = POINT_QUERY;
+			P = &point;
+			P->center[X] = atoi(query_queue[i].args[0]);
+			P->center[Y] = atoi(query_queue[i].args[1]);
+			P->lenght[X] = P->lenght[Y] = 0;
+		} else {
+			kind = RECTANGLE_QUERY;
+			if ((P = find_rectangle(query_queue[i].args[0])) == NULL)
+				continue; // answered by rectangle_search without a search
+		}
+		rect_region(P, lo, hi);
+
+		if ((e = cache_lookup(kind, lo, hi)) != NULL) {
+			if (e->pending == 0) {
+				query_cached[i] = 1;
+				query_result[i] = e->rect;
+			}
+			continue;
+		}
+		e = cache_store(kind, lo, hi);
+		e->pending = i + 1;
+		query_entry[i] = e - query_cache.entry;
+	}
+}
+
+static void store_queries(void) {
+	/*
+	** Fills in the entries probe_queries stored, unless a later query of the run took
+	** them over
+	*/
+	cache_entry_t *e;
+	int i;
+
+	for (i = 0; i < queued_queries; i++) {
+		if (query_entry[i] < 0)
+			continue;
+		e = &query_cache.entry[query_entry[i]];
+		if (e->pending == i + 1) {
+			e->rect = query_result[i];
+			e->pending = 0;
+		}
+	}
+}
+
+static void flush_queries(void) {
+	/*
+	** Runs the queued queries on query_pool. They only read the quadtree, and the chunk
+	** buffers are printed in order, so the output is the same as running them one by one.
+	*/
+	char *text[QUERY_CHUNKS];
+	int c, i;
+
+	if (queued_queries == 0)
+		return;
+
+	probe_queries();
+	queries_in_parallel = 1;
+	bulk_run(&query_pool, run_query_chunk, text, QUERY_CHUNKS);
+	queries_in_parallel = 0;
+	store_queries();
+
+	for (c = 0; c < QUERY_CHUNKS; c++) {
+		fputs(text[c], stdout);
+		free(text[c]);
+	}
+	for (i = 0; (i < queued_queries) && latencies.recording; i++)
+		latency_record(&latencies, &query_queue[i], 1, query_ticks[i], query_nodes[i]);
+	queued_queries = 0;
+}
+
+static void drain_routed(void) {
+	/*
+	** Reads the replies to the commands sent ahead and prints the answers in order. Each
+	** worker answers its commands in the order it got them. A command is timed from its
+	** sending to the reading of its replies.
+	*/
+	unsigned long end;
+	int i;
+
+	for (i = 0; i < routed_commands; i++) {
+		gather_routed(routed_workers[i]);
+		route_reply(stdout, &routed_queue[i], routed_workers[i]);
+		if (latencies.recording) {
+			end = latency_ticks();
+			latency_record(&latencies, &routed_queue[i], 1, end - routed_ticks[i], 0);
+		}
+	}
+	routed_commands = 0;
+}
+
+static void post_routed(command_t *command) {
+	/*
+	** Sends command to its workers without waiting for their replies, so that the router
+	** goes on to the next command while the workers run this one
+	*/
+	if (routed_commands == SHARD_PIPELINE)
+		drain_routed();
+	routed_queue[routed_commands] = *command;
+	if (latencies.recording)
+		routed_ticks[routed_commands] = latency_ticks();
+	routed_workers[routed_commands] = route_send(command);
+	routed_commands++;
+}
+
+static inline int pipelined_route(command_t *command) {
+	return (shard_router.n > 0) && (command->completion == NULL) && (command->malformed == NULL) && routed_alone(command);
+}
+
+static inline int parallel_query(command_t *command) {
+	return (query_pool.threads > 1) && (shard_router.n == 0) && !trace && (command->completion == NULL)
+		&& ((strcmp(command->name, "SEARCH_POINT") == 0) || (strcmp(command->name, "RECTANGLE_SEARCH") == 0));
+}
+
+static void apply_commands(command_t *batch, int n) {
+	/*
+	** Runs on the writer thread for every batch drained from the ingestion ring. Untraced
+	** runs of INSERT commands are reordered by insert_run; everything else is applied one
+	** command at a time, in order. A sharded quadtree routes every command to its workers.
+	** The output of a command with a completion slot goes to the slot instead of stdout.
+	** With query threads, runs of point and rectangle searches are queued across batches
+	** and run in parallel before the next other command, or once the ring has drained.
+	** Likewise a sharded quadtree sends the commands route_send answers ahead, and reads
+	** their replies before the next other command, once SHARD_PIPELINE are pending, or once
+	** the ring has drained.
+	** Every command is timed for LATENCY() and the slow command log. The clock is read once
+	** between two commands applied in a row, so the second one is also charged for the
+	** recording of the first.
+	*/
+	unsigned long start = 0, end;
+	FILE *out;
+	int i, j, timing = 0;
+
+	for (i = 0; i < n; i = j) {
+		j = i + 1;
+		if (parallel_query(&batch[i])) {
+			query_queue[queued_queries++] = batch[i];
+			if (queued_queries == QUERY_QUEUE_SIZE)
+				flush_queries();
+			timing = 0;
+			continue;
+		}
+		if (pipelined_route(&batch[i])) {
+			post_routed(&batch[i]);
+			timing = 0;
+			continue;
+		}
+
+		if (!timing) {
+			flush_queries();
+			drain_routed();
+			if ((timing = latencies.recording))
+				start = latency_ticks();
+		}
+		nodes_visited = 0;
+		if ((shard_router.n == 0) && !trace && (strcmp(batch[i].name, "INSERT") == 0)) {
+			while ((j < n) && (strcmp(batch[j].name, "INSERT") == 0))
+				j++;
+			insert_run(&batch[i], j - i);
+		}
+		else {
+			out = reply_open(&batch[i]);
+			trace_out = out;
+			if (batch[i].malformed != NULL)
+				fprintf(out, "COMMAND REJECTED: %s\n", batch[i].malformed);
+			else if (shard_router.n > 0)
+				route_command(out, &batch[i]);
+			else if (strcmp(batch[i].name, "TRACE") == 0)
+				trace = (strcmp(batch[i].args[0], "ON") == 0);
+			else
+				decode_command(out, batch[i].name, batch[i].args);
+			reply_close(out);
+		}
+		if (timing) {
+			end = latency_ticks();
+			// Logging a slow command takes long enough to restart the clock
+			timing = !latency_record(&latencies, &batch[i], j - i, end - start, nodes_visited) && latencies.recording;
+			start = end;
+		}
+	}
+	if (n == 0) {
+		flush_queries();
+		drain_routed();
+		// A shard worker hands its replies to the router once it has run every command sent
+		fflush(stdout);
+	}
+	// The workers start on the commands sent ahead while the next batch is read
+	else if (routed_commands > 0)
+		shard_flush(&shard_router);
+}
+
+static int parse_command(FILE *in, command_t *command)
+{
+	/*
+	** Reads the next command line of in into command. Returns 0 at the end of in. A line
+	** that is too long, or has too many or too long arguments, is read to its end and
+	** comes back nameless, with the reason it was rejected in malformed.
+	*/
+	char input[MAX_STRING_LEN];
+	int c, len = 0, i, j = 0, k = 0;
+
+	memset(command, 0, sizeof(command_t)); // optional trailing arguments read as empty strings
+
+	while ((c = getc(in)) != '\n') {
+		if (c == EOF)
+			return 0;
+		if (len < MAX_STRING_LEN - 1)
+			input[len++] = c;
+		else
+			command->malformed = "LINE TOO LONG";
+	}
+
+	for (i = 0; (i < len) && (input[i] != '(') && (input[i] != ' '); i++)
+		command->name[i] = input[i];
+	command->name[i] = '\0';
+
+	if (strcmp(command->name, "TRACE") != 0) {
+		for (++i; (i < len) && (input[i] != ')') && (command->malformed == NULL); i++) {
+			if (input[i] != ',')
+				command->args[j][k++] = input[i];
+			else if (++j < MAX_ARGS)
+				k = 0;
+			else
+				command->malformed = "TOO MANY ARGUMENTS";
+			if (k > MAX_NAME_LEN)
+				command->malformed = "ARGUMENT TOO LONG";
+		}
 	} else {
 		i = i + 2;
-		if (input[i] == 'N') // "N" from "ON"
-			trace = 1;
+		if ((i < len) && (input[i] == 'N')) // "N" from "ON"
+			strcpy(command->args[0], "ON");
 		else
-			trace = 0;
+			strcpy(command->args[0], "OFF");
+	}
+
+	if (command->malformed != NULL) {
+		memset(command->name, 0, sizeof(command->name));
+		memset(command->args, 0, sizeof(command->args));
+		command->latency = -1;
+		return 1;
 	}
 
-	i = 0;
-	j = 0;
-	k = 0;
+	// Found here, on the producer thread, rather than by the writer for every record
+	command->latency = latency_kind(&latencies, command->name);
+	return 1;
 }
-	return;
+
+static void read_command(void)
+{
+	command_t command;
+
+	while (parse_command(stdin, &command))
+		ingest_push(&ingest_ring, &command);
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+	/*
+	** quadtree [-s n] [-j n] [-l usec] [-u path]: -s runs the quadtree sharded over n worker
+	** processes, -j runs the point and rectangle searches on n threads, -l logs the commands
+	** taking more than usec microseconds to the standard error, and -u also takes commands
+	** from the clients of a Unix socket at path, until the standard input ends
+	*/
+	int i, shards = 0, threads = 1;
+	int sharded = 0;
+	double slow_usec = 0;
+	char *socket_path = NULL;
+
+	for (i = 1; i < argc; i += 2) {
+		if ((i + 1 < argc) && (strcmp(argv[i], "-s") == 0)) {
+			shards = atoi(argv[i + 1]);
+			sharded = 1;
+		}
+		else if ((i + 1 < argc) && (strcmp(argv[i], "-j") == 0))
+			threads = atoi(argv[i + 1]);
+		else if ((i + 1 < argc) && (strcmp(argv[i], "-l") == 0))
+			slow_usec = atof(argv[i + 1]);
+		else if ((i + 1 < argc) && (strcmp(argv[i], "-u") == 0))
+			socket_path = argv[i + 1];
+		else {
+			fprintf(stderr, "usage: quadtree [-s shards] [-j threads] [-l usec] [-u path]\n");
+			return (1);
+		}
+	}
+	if (sharded && ((shards < 1) || (shards > MAX_SHARDS))) {
+		fprintf(stderr, "quadtree: number of shards must be in [1,%d]\n", MAX_SHARDS);
+		return (1);
+	}
+	if ((threads < 1) || (threads > MAX_BULK_THREADS)) {
+		fprintf(stderr, "quadtree: number of threads must be in [1,%d]\n", MAX_BULK_THREADS);
+		return (1);
+	}
+	if (slow_usec < 0) {
+		fprintf(stderr, "quadtree: slow command threshold must not be negative\n");
+		return (1);
+	}
+
+	if (sharded && !shard_spawn(&shard_router, shards)) {
+		// The router logs the slow commands and serves the clients
+		slow_usec = 0;
+		socket_path = NULL;
+	}
+	if ((threads > 1) && (shard_router.n == 0)) // the router runs no queries itself
+		bulk_start(&query_pool, threads);
+
 	init_mx_cif_tree();
 	init_rect_tree();
+	init_query_cache();
+	latency_start(&latencies, slow_usec, stderr);
+	ingest_start(&ingest_ring, apply_commands);
+	if ((socket_path != NULL) && !server_start(&server, socket_path, &ingest_ring, parse_command)) {
+		fprintf(stderr, "quadtree: cannot listen on %s\n", socket_path);
+		socket_path = NULL;
+	}
 
 	read_command();
 
+	if (socket_path != NULL)
+		server_stop(&server);
+	ingest_stop(&ingest_ring);
+	if (shard_router.n > 0)
+		shard_shutdown(&shard_router);
+	if (query_pool.threads > 1)
+		bulk_stop(&query_pool);
+
 	return (0);
 }
@@ -3,34 +3,172 @@
 
 #define MAX_STRING_LEN 256
 #define MAX_NAME_LEN 6
+#define MAX_ARGS 10 //Most arguments of a command
 
 #define NDIR_1D 2 //number of directions in 1d space
 #define NDIR_2D 4 ///number of directions in 2d space
 
+#define MAX_WIDTH 30 //Largest INIT_QUADTREE parameter, so that 1 << width fits in an int
+#define MAX_DEPTH (MAX_WIDTH + 2) //Bound on the depth of the quadtree and of any axis bin tree
+#define QUERY_CACHE_SIZE 256 //Entries kept by the query result cache
+#define QUERY_CACHE_BUCKETS 512 //Hash buckets of the query result cache, a power of 2
+#define WALK_STACK_SIZE (4 * MAX_DEPTH + 6) //3 pending siblings per quadtree level, plus one axis walk
+#define QUERY_QUEUE_SIZE 8192 //Most read-only queries run in parallel at once
+#define QUERY_CHUNKS 64 //Pieces a run of queries is split into for the query threads
+#define POOL_SHIFT 10
+#define POOL_BLOCK (1 << POOL_SHIFT) //Objects carved at a time by a pool
+#define POOL_COLUMNS 3 //Optional fields a pool can keep for its objects
+#define NAME_POOL_BLOCK 4096 //Bytes carved at a time by the name pool
+
 typedef enum {X, Y} axis;
 typedef enum {NW, NE, SW, SE} quadrant; //Use this ordering in traversal
 typedef enum {LEFT, RIGHT, BOTH} direction;
 
-typedef struct {
-	char *rect_name; //Name of the rectangle
-	struct rectangle *bson[NDIR_1D]; //Left and right sons
+typedef unsigned int ref_t; //Index of an object in its pool, 0 for none
+
+typedef struct rectangle {
+	char *rect_name; //Name of the rectangle, kept in the name pool
+	ref_t bson[NDIR_1D]; //Left and right sons in the tree of rectangle names
 	int center[NDIR_1D]; //Centroid
 	int	lenght[NDIR_1D]; //Distance to the borders of rect
 	int label; //Used for LABEL() operation
+	int placed; //Set while the rectangle is in a sharded quadtree; inserting it again leaves one copy
 } rectangle_t;
 
+typedef struct {
+	int count; //Number of rectangles in the subtree
+	long area; //Sum of their areas
+	int lo[NDIR_1D]; //Bounding box [lo, hi) of those rectangles, valid when count > 0
+	int hi[NDIR_1D];
+} summary_t; //Subtree aggregate kept on the MX-CIF nodes
+
 typedef struct bnode {
-	struct bnode *bson[NDIR_1D]; //Left and right sons
-	rectangle_t *rect; //Pointer to the rectangle whose area contains the axis subdivision point
+	ref_t bson[NDIR_1D]; //Left and right sons
+	ref_t rect; //Rectangle whose area contains the axis subdivision point
 } bnode_t;
 
 typedef struct cnode {
-	struct cnode *qson[NDIR_2D]; //Four principal quad directions
-	bnode_t *bson[NDIR_1D]; //Pointers to rectangle sets for each of the axis
+	ref_t qson[NDIR_2D]; //Four principal quad directions
+	ref_t bson[NDIR_1D]; //Rectangle sets for each of the axis
 } cnode_t;
 
+typedef struct {
+	unsigned long version; //Stamp of the last mutation in the subtree
+	unsigned long own_version; //Stamp of the last mutation of the axis trees
+} stamps_t; //Mutation stamps of a quadtree node, kept while the query cache is on
+
+typedef enum {
+	SUM_COLUMN, //summary_t of the subtree, kept once a query has needed the summaries
+	SHARES_COLUMN, //int count of the links to the node beyond the first, kept while a version is pinned
+	STAMPS_COLUMN //stamps_t of a quadtree node, kept while the query cache is on
+} column_kind;
+
+typedef struct {
+	size_t size; //Bytes per object, 0 while the column is not kept
+	char **block; //Values of the objects of each block of the pool
+} column_t; //Optional field of the objects of a pool, stored apart from them
+
+typedef struct {
+	ref_t *R; //Link to the axis node to visit
+	int Cv; //Axis subdivision point at that node
+	int Lv; //Half-width of the interval at that node
+	int step; //Added to the bin node number before the visit (trace numbering)
+	int depth; //Level of the node below the axis root
+	direction dir; //Son of its parent the node is (deletion only)
+} axis_frame_t; //Pending subtree in the iterative axis traversals
+
+typedef struct {
+	direction dir; //Son taken from the level above
+	int split; //Whether the search split at this level
+} axis_step_t; //Level of the path to an axis node found for deletion
+
+typedef struct {
+	int levels; //Halvings until the square is one cell wide, 0 when the descent is done step by step
+	int corner[NDIR_1D]; //Lower left corner of the square the descent starts from
+	unsigned long long key; //Quadrant of each level, two bits per level from the most significant end
+} descent_t; //Quadrants followed by a point descending the MX-CIF quadtree, read off its bits
+
+typedef struct {
+	int is_axis; //Whether node is an axis bnode_t rather than a cnode_t
+	ref_t node; //Node to visit
+} walk_frame_t; //Pending subtree of a window traversal
+
+typedef struct {
+	int open; //Set while the cursor may still yield rectangles
+	ref_t root; //Version of the quadtree pinned by the cursor
+	int lo[NDIR_1D]; //Query window is [lo, hi) on each axis
+	int hi[NDIR_1D];
+	int top; //Number of pending frames
+	walk_frame_t stack[WALK_STACK_SIZE];
+} cursor_t; //Resumable window query over the MX-CIF quadtree
+
+typedef enum {POINT_QUERY, RECTANGLE_QUERY, WINDOW_QUERY} query_kind;
+
+typedef struct {
+	query_kind kind;
+	int lo[NDIR_1D]; //Query region [lo, hi); a point query has lo == hi
+	int hi[NDIR_1D];
+	unsigned long stamp; //Mutation stamp when the result was computed
+	rectangle_t *rect; //Result of a point or rectangle query
+	summary_t sum; //Result of a window query
+	int hash_next; //Next entry in the same bucket, -1 at the end
+	int lru_prev; //Neighbours in recency order, -1 at the ends
+	int lru_next;
+	int pending; //Queued query (plus one) whose result the entry waits for, see probe_queries
+} cache_entry_t;
+
+typedef struct {
+	int enabled;
+	int count; //Entries in use
+	int allocated; //Entries taken from entry[] so far
+	int free_list; //Invalidated entries, chained through hash_next
+	int lru_head; //Most recently used entry
+	int lru_tail; //Least recently used entry, evicted first
+	int bucket[QUERY_CACHE_BUCKETS];
+	cache_entry_t entry[QUERY_CACHE_SIZE];
+	unsigned long hits, misses, invalidated;
+} query_cache_t; //LRU cache of query results, validated against the quadtree version stamps
+
+typedef struct {
+	size_t size; //Bytes per object
+	ref_t free_list; //Released objects, chained through their first word
+	ref_t carved; //Objects carved so far, object 0 is never handed out
+	long live; //Objects in use
+	int blocks; //Blocks allocated
+	int cap; //Room in the block tables
+	char **block; //Object i lives in block[i >> POOL_SHIFT]
+	column_t column[POOL_COLUMNS];
+} pool_t; //Allocator for objects of one size, addressed by 32-bit index
+
+typedef struct {
+	char *block; //Block names are being copied to
+	size_t used; //Bytes of block in use
+	long bytes; //Bytes of all the names
+} name_pool_t; //Rectangle names, which are never freed
+
+typedef enum {PROBE_JOIN, SWEEP_JOIN} join_engine;
+
+typedef struct {
+	rectangle_t *rect;
+	int lo[NDIR_1D]; //Extent [lo, hi) of rect
+	int hi[NDIR_1D];
+	int rank; //Position in lo[Y] order, the leaf of the item in the sweep's interval tree
+} join_item_t; //Rectangle taking part in a spatial join
+
+typedef struct {
+	rectangle_t *rect[NDIR_1D]; //The two rectangles, the first one smaller in join order
+} join_pair_t;
+
+typedef struct {
+	int n; //Rectangles taking part
+	join_item_t *item;
+	int pairs; //Overlapping pairs found so far
+	int cap; //Pairs pair[] has room for
+	join_pair_t *pair;
+} join_t; //State of one SPATIAL_JOIN
+
 struct mxcif {
-	struct cnode *mx_cif_root; //Root Node
+	ref_t mx_cif_root; //Root Node
 	rectangle_t world; //World extent
 	int id; //Quadtree ID
 };
@@ -0,0 +1,133 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+/*
+	server.c
+
+	A client has one command in the ring at a time: its thread waits on the
+	completion slot before reading the next command. Clients still pipeline
+	by writing commands ahead of the replies, and the writer thread batches
+	the commands of all the clients together.
+*/
+
+typedef struct client {
+	server_t *server;
+	int fd;
+	struct client *next; //Next connection in server->clients
+} client_t;
+
+static void server_leave(client_t *client) {
+	/*
+	** Unlinks client before its socket is closed, so that server_stop never shuts down
+	** a descriptor that has been reused
+	*/
+	server_t *server = client->server;
+	client_t **link;
+
+	pthread_mutex_lock(&server->lock);
+	for (link = &server->clients; *link != client; link = &(*link)->next)
+		;
+	*link = client->next;
+	if (server->clients == NULL)
+		pthread_cond_signal(&server->idle);
+	pthread_mutex_unlock(&server->lock);
+}
+
+static void *server_client(void *arg) {
+	client_t *client = arg;
+	server_t *server = client->server;
+	FILE *in = fdopen(client->fd, "r");
+	FILE *out = fdopen(dup(client->fd), "w");
+	completion_t completion;
+	command_t command;
+
+	while (server->read(in, &command)) {
+		atomic_init(&completion.done, 0);
+		completion.reply = NULL;
+		completion.len = 0;
+		command.completion = &completion;
+		ingest_push(server->ring, &command);
+		ingest_wait(server->ring, &completion);
+		fwrite(completion.reply, 1, completion.len, out);
+		fflush(out);
+		free(completion.reply);
+	}
+	server_leave(client);
+	fclose(in);
+	fclose(out);
+	free(client);
+	return NULL;
+}
+
+static void *server_accept(void *arg) {
+	server_t *server = arg;
+	client_t *client;
+	pthread_t thread;
+	int fd;
+
+	// Fails once server_stop shuts the socket down
+	while ((fd = accept(server->fd, NULL, NULL)) >= 0) {
+		client = (client_t *)malloc(sizeof(client_t));
+		client->server = server;
+		client->fd = fd;
+		pthread_mutex_lock(&server->lock);
+		client->next = server->clients;
+		server->clients = client;
+		pthread_mutex_unlock(&server->lock);
+		pthread_create(&thread, NULL, server_client, client);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+int server_start(server_t *server, char *path, ingest_ring_t *ring, server_read_t read) {
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return 0;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	strcpy(server->path, path);
+
+	server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if ((server->fd < 0) || (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(server->fd, 64) != 0)) {
+		if (server->fd >= 0)
+			close(server->fd);
+		return 0;
+	}
+
+	server->ring = ring;
+	server->read = read;
+	server->clients = NULL;
+	// A client that leaves before its reply is written must not kill the process
+	signal(SIGPIPE, SIG_IGN);
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->idle, NULL);
+	pthread_create(&server->acceptor, NULL, server_accept, server);
+	return 1;
+}
+
+void server_stop(server_t *server) {
+	client_t *client;
+
+	shutdown(server->fd, SHUT_RDWR);
+	pthread_join(server->acceptor, NULL);
+	close(server->fd);
+
+	// The threads of the clients read the end of their input and leave
+	pthread_mutex_lock(&server->lock);
+	for (client = server->clients; client != NULL; client = client->next)
+		shutdown(client->fd, SHUT_RDWR);
+	while (server->clients != NULL)
+		pthread_cond_wait(&server->idle, &server->lock);
+	pthread_mutex_unlock(&server->lock);
+	unlink(server->path);
+}
@@ -0,0 +1,45 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+/*
+	server.h
+
+	Unix socket front end of the ingestion ring. Every client connection has
+	a producer thread of its own, which reads the client's commands, pushes
+	each one with a completion slot and writes the reply back to the client
+	once the writer thread has applied the command. A client sees the replies
+	to its commands in order; commands of different clients interleave.
+*/
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "ingest.h"
+
+typedef int (*server_read_t)(FILE *in, command_t *command);
+
+struct client; //Connection of a client, see server.c
+
+typedef struct {
+	int fd; //Listening socket
+	char path[108]; //Where the socket is bound
+	ingest_ring_t *ring; //Ring the commands of the clients are pushed to
+	server_read_t read; //Parses the next command of a client, returns 0 at the end
+	pthread_t acceptor;
+	pthread_mutex_t lock;
+	pthread_cond_t idle; //Signalled when the last client leaves
+	struct client *clients; //Connections being served, linked through their next fields
+} server_t;
+
+/*	Listens on the Unix socket path and serves the clients connecting to it
+	from new threads. Returns 0 if the socket cannot be set up. */
+
+extern int server_start(server_t *server, char *path, ingest_ring_t *ring, server_read_t read);
+
+/*	Stops accepting clients, shuts the connections of the connected ones
+	down, waits for their threads to leave and removes the socket. A
+	command a client has already sent is still applied. */
+
+extern void server_stop(server_t *server);
+
+#endif /* SERVER_H_ */
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "shard.h"
+
+/*
+	shard.c
+
+	Every command sent to a worker is followed by SYNC(), which the worker
+	answers with a line holding SYNC once all earlier output is written. The
+	router reads each reply up to that line.
+*/
+
+static unsigned int morton_key(unsigned int gx, unsigned int gy, int level) {
+	unsigned int key = 0;
+	int b;
+
+	for (b = 0; b < level; b++) {
+		key |= ((gx >> b) & 1) << (2 * b);
+		key |= ((gy >> b) & 1) << (2 * b + 1);
+	}
+	return key;
+}
+
+int shard_spawn(shard_router_t *router, int n) {
+	int sv[2], w, c;
+
+	router->n = n;
+	router->width = 0;
+	for (c = 0; c < SHARD_CELLS; c++)
+		router->load[c] = 0;
+	// Whole cells to begin with, cell c going to worker c * n / SHARD_CELLS
+	for (w = 0; w <= n; w++)
+		router->bound[w] = (unsigned int)(((long)w * SHARD_CELLS + n - 1) / n) * SHARD_CELL_KEYS;
+
+	fflush(stdout);
+	for (w = 0; w < n; w++) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+		router->pid[w] = fork();
+		if (router->pid[w] == 0) {
+			// The worker only keeps its own socket, as its standard input and output
+			for (c = 0; c < w; c++) {
+				close(fileno(router->to[c]));
+				close(fileno(router->from[c]));
+			}
+			close(sv[0]);
+			dup2(sv[1], STDIN_FILENO);
+			dup2(sv[1], STDOUT_FILENO);
+			close(sv[1]);
+			router->n = 0;
+			return 0;
+		}
+		close(sv[1]);
+		router->to[w] = fdopen(sv[0], "w");
+		router->from[w] = fdopen(dup(sv[0]), "r");
+	}
+	return 1;
+}
+
+void shard_send(shard_router_t *router, int w, command_t *command) {
+	int a;
+
+	fprintf(router->to[w], "%s(", command->name);
+	for (a = 0; (a < MAX_ARGS) && (command->args[a][0] != '\0'); a++)
+		fprintf(router->to[w], a == 0 ? "%s" : ",%s", command->args[a]);
+	fprintf(router->to[w], ")\nSYNC()\n");
+}
+
+void shard_flush(shard_router_t *router) {
+	int w;
+
+	for (w = 0; w < router->n; w++)
+		fflush(router->to[w]);
+}
+
+void shard_receive(shard_router_t *router, int w, reply_t *reply) {
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	fflush(router->to[w]);
+	reply->len = 0;
+	while ((len = getline(&line, &size, router->from[w])) > 0) {
+		if (strcmp(line, "SYNC\n") == 0)
+			break;
+		if (reply->len + len + 1 > reply->cap) {
+			reply->cap = 2 * (reply->len + len + 1);
+			reply->text = (char *)realloc(reply->text, reply->cap);
+		}
+		memcpy(reply->text + reply->len, line, len);
+		reply->len += len;
+	}
+	if (reply->text == NULL) {
+		reply->cap = 1;
+		reply->text = (char *)malloc(1);
+	}
+	reply->text[reply->len] = '\0';
+	free(line);
+}
+
+int shard_owner(shard_router_t *router, unsigned int bound[], unsigned int key) {
+	int w = router->n - 1;
+
+	// Empty ranges are skipped, as their bound equals the next one
+	while (bound[w] > key)
+		w--;
+	return w;
+}
+
+unsigned long shard_workers(shard_router_t *router, unsigned int bound[], int lo[], int hi[], int touch) {
+	long f_lo[2], f_hi[2], last = (1L << SHARD_SPLIT_LEVEL) - 1, split = SHARD_SPLIT_LEVEL - SHARD_LEVEL;
+	unsigned long workers = 0;
+	long gx, gy, fx, fy;
+	unsigned int c;
+	int v, first;
+
+	// Grid coordinates of the split quadrants meeting the region; a point is a one unit region
+	for (v = 0; v < 2; v++) {
+		f_lo[v] = ((long)lo[v] << SHARD_SPLIT_LEVEL) >> router->width;
+		f_hi[v] = ((((long)(hi[v] > lo[v] ? hi[v] : lo[v] + 1)) << SHARD_SPLIT_LEVEL) - 1) >> router->width;
+		f_lo[v] = f_lo[v] < 0 ? 0 : (f_lo[v] > last ? last : f_lo[v]);
+		f_hi[v] = f_hi[v] < 0 ? 0 : (f_hi[v] > last ? last : f_hi[v]);
+	}
+
+	for (gx = f_lo[0] >> split; gx <= f_hi[0] >> split; gx++)
+		for (gy = f_lo[1] >> split; gy <= f_hi[1] >> split; gy++) {
+			c = morton_key(gx, gy, SHARD_LEVEL);
+			if (touch)
+				router->load[c]++;
+			first = shard_owner(router, bound, c * SHARD_CELL_KEYS);
+			if (first == shard_owner(router, bound, (c + 1) * SHARD_CELL_KEYS - 1)) {
+				workers |= 1UL << first;
+				continue;
+			}
+			// A split cell: only the quadrants of it meeting the region count
+			for (fx = (gx << split > f_lo[0] ? gx << split : f_lo[0]); fx <= f_hi[0] && (fx >> split) == gx; fx++)
+				for (fy = (gy << split > f_lo[1] ? gy << split : f_lo[1]); fy <= f_hi[1] && (fy >> split) == gy; fy++)
+					workers |= 1UL << shard_owner(router, bound, morton_key(fx, fy, SHARD_SPLIT_LEVEL));
+		}
+	return workers;
+}
+
+void shard_rebalance(shard_router_t *router) {
+	/*
+	** Worker w starts where the weight before it reaches w / n of the total. All the
+	** weights are scaled by n to keep to integers.
+	*/
+	unsigned long total = 0, before = 0, weight, target;
+	unsigned int c = 0, n = router->n;
+	int w;
+
+	// Every cell weighs at least 1, so that idle space is spread evenly too
+	for (c = 0; c < SHARD_CELLS; c++)
+		total += router->load[c] + 1;
+
+	c = 0;
+	for (w = 1; w < router->n; w++) {
+		target = w * total;
+		while ((before + router->load[c] + 1) * n <= target)
+			before += router->load[c++] + 1;
+		weight = router->load[c] + 1;
+
+		if ((before * n < target) && (weight * n > total))
+			router->bound[w] = c * SHARD_CELL_KEYS + (unsigned int)(((target - before * n) * SHARD_CELL_KEYS + weight * n - 1) / (weight * n));
+		else
+			router->bound[w] = (before * n < target ? c + 1 : c) * SHARD_CELL_KEYS;
+	}
+	router->bound[0] = 0;
+	router->bound[router->n] = SHARD_KEYS;
+
+	for (c = 0; c < SHARD_CELLS; c++)
+		router->load[c] = 0;
+}
+
+void shard_shutdown(shard_router_t *router) {
+	int w;
+
+	for (w = 0; w < router->n; w++) {
+		fclose(router->to[w]);
+		fclose(router->from[w]);
+	}
+	for (w = 0; w < router->n; w++)
+		waitpid(router->pid[w], NULL, 0);
+	router->n = 0;
+}
+
+void reply_free(reply_t *reply) {
+	free(reply->text);
+	reply->text = NULL;
+	reply->len = reply->cap = 0;
+}
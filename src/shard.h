@@ -0,0 +1,89 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+/*
+	shard.h
+
+	Worker processes for a sharded MX-CIF quadtree. The world is cut into the
+	Morton-ordered quadrants SHARD_LEVEL levels below the root (the cells), and
+	every worker owns a contiguous range of the Morton order. The ranges start
+	and end on the quadrants SHARD_SPLIT_LEVEL levels below the root, so that a
+	cell drawing more than a worker's share of the load is split between
+	workers. Each worker is a copy of this program reading commands from, and
+	printing replies to, a Unix socket; the router in the parent process
+	decides which workers a command goes to.
+*/
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "ingest.h"
+
+#define MAX_SHARDS 16 //Most worker processes
+#define SHARD_LEVEL 4 //Depth of the quadrants used as cells
+#define SHARD_CELLS (1 << (2 * SHARD_LEVEL))
+#define SHARD_SPLIT_LEVEL 8 //Depth of the quadrants a hot cell is split into
+#define SHARD_KEYS (1 << (2 * SHARD_SPLIT_LEVEL)) //Morton keys of the quadrants at SHARD_SPLIT_LEVEL
+#define SHARD_CELL_KEYS (SHARD_KEYS / SHARD_CELLS) //Keys in one cell
+#define SHARD_PIPELINE 64 //Most commands sent ahead of reading their replies, few enough for a socket buffer to hold
+
+typedef struct {
+	char *text; //Reply lines of one worker, without the closing SYNC line
+	size_t len;
+	size_t cap;
+} reply_t;
+
+typedef struct {
+	int n; //Worker processes, 0 when the quadtree is not sharded
+	pid_t pid[MAX_SHARDS];
+	FILE *to[MAX_SHARDS]; //Command stream of each worker
+	FILE *from[MAX_SHARDS]; //Reply stream of each worker
+	unsigned int bound[MAX_SHARDS + 1]; //Worker w owns the keys [bound[w], bound[w + 1])
+	unsigned long load[SHARD_CELLS]; //Requests that touched each cell since the last rebalance
+	int width; //INIT_QUADTREE parameter, the world is 2^width wide
+} shard_router_t;
+
+/*	Forks n workers connected to router. Returns 1 in the router and 0 in
+	each worker, whose standard input and output are then its socket. */
+
+extern int shard_spawn(shard_router_t *router, int n);
+
+/*	Sends command to worker w. Several workers can be sent a command before
+	their replies are collected, so that they run in parallel, and a worker
+	can be sent several commands ahead. The commands are buffered until
+	shard_flush or until a reply of the worker is read. */
+
+extern void shard_send(shard_router_t *router, int w, command_t *command);
+
+/*	Writes out the commands buffered for every worker. */
+
+extern void shard_flush(shard_router_t *router);
+
+/*	Reads the reply of worker w to the oldest command it has not answered. */
+
+extern void shard_receive(shard_router_t *router, int w, reply_t *reply);
+
+/*	Returns the set of workers (bit w for worker w) owning a part of the world
+	that meets the region [lo, hi), according to the ranges bound. With touch
+	set, the load of the cells met is counted for the next rebalance. */
+
+extern unsigned long shard_workers(shard_router_t *router, unsigned int bound[], int lo[], int hi[], int touch);
+
+/*	Returns the worker owning key according to the ranges bound. */
+
+extern int shard_owner(shard_router_t *router, unsigned int bound[], unsigned int key);
+
+/*	Reassigns the ranges so that every worker gets about the same load and
+	clears the load counters. A range ends on a cell boundary unless the cell
+	it ends in is hot, in which case the cell is split, its load taken as
+	spread evenly over it. */
+
+extern void shard_rebalance(shard_router_t *router);
+
+/*	Closes the command streams and waits for the workers to exit. */
+
+extern void shard_shutdown(shard_router_t *router);
+
+extern void reply_free(reply_t *reply);
+
+#endif /* SHARD_H_ */